@@ -8,12 +8,18 @@
 // External includes
 #include <assert.h>
 #include <nap/logger.h>
+#include <charconv>
 
 // Base class
 RTTI_BEGIN_CLASS(nap::PJLinkCommand)
 	RTTI_CONSTRUCTOR(const std::string&, const std::string&)
-	RTTI_PROPERTY("Command",	&nap::PJLinkCommand::mCommand,		nap::rtti::EPropertyMetaData::Default)
-	RTTI_PROPERTY("Response",	&nap::PJLinkCommand::mResponse,		nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("State",		&nap::PJLinkCommand::mState,		nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("Timeout",	&nap::PJLinkCommand::mTimeout,		nap::rtti::EPropertyMetaData::Default)
+	RTTI_PROPERTY("Priority",	&nap::PJLinkCommand::mPriority,		nap::rtti::EPropertyMetaData::Default)
+	RTTI_FUNCTION("getCommandMessage",	&nap::PJLinkCommand::getCommandMessage)
+	RTTI_FUNCTION("setCommandMessage",	&nap::PJLinkCommand::setCommandMessage)
+	RTTI_FUNCTION("getResponseMessage",	&nap::PJLinkCommand::getResponseMessage)
+	RTTI_FUNCTION("setResponseMessage",	&nap::PJLinkCommand::setResponseMessage)
 RTTI_END_CLASS
 
 // Set commands
@@ -49,6 +55,23 @@ RTTI_BEGIN_ENUM(nap::PJLinkCommand::EResponseCode)
 	RTTI_ENUM_VALUE(nap::PJLinkCommand::EResponseCode::ProjectorError,		"Projector Failure")
 RTTI_END_ENUM
 
+RTTI_BEGIN_ENUM(nap::PJLinkCommand::EState)
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::Pending,					"Pending"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::Completed,					"Completed"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::ConnectionFailed,			"Connection Failed"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::ConnectionTimedOut,			"Connection Timed Out"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::ConnectionClosed,			"Connection Closed"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::ResponseTimedOut,			"Response Timed Out"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::Dropped,					"Dropped"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::Rejected,					"Rejected"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EState::CircuitOpen,				"Circuit Open")
+RTTI_END_ENUM
+
+RTTI_BEGIN_ENUM(nap::PJLinkCommand::EPriority)
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EPriority::Control,					"Control"),
+	RTTI_ENUM_VALUE(nap::PJLinkCommand::EPriority::Telemetry,				"Telemetry")
+RTTI_END_ENUM
+
 RTTI_BEGIN_ENUM(nap::PJLinkGetPowerCommand::EStatus)
 	RTTI_ENUM_VALUE(nap::PJLinkGetPowerCommand::EStatus::Off,				"Off"),
 	RTTI_ENUM_VALUE(nap::PJLinkGetPowerCommand::EStatus::On,				"On"),
@@ -91,86 +114,64 @@ RTTI_END_ENUM
 
 namespace nap
 {
-	static std::string createCmd(const std::string& cmd, const std::string& value)
+	static void createCmd(pjlink::Message& outCmd, std::string_view cmd, std::string_view value)
 	{
-		std::string r;
-		r.reserve(value.size() + 8);
-		r += pjlink::cmd::header;
-		r += pjlink::cmd::version;
-		r += cmd;
-		r += pjlink::cmd::seperator;
-		r += value;
-		r += pjlink::terminator;
-
-		assert(r.size() < pjlink::cmd::size);
-		assert(sizeof(std::string::value_type) == sizeof(char));
-		return r;
+		assert(cmd.size() + value.size() + 4 <= pjlink::cmd::size);
+		outCmd.clear();
+		outCmd.append(pjlink::cmd::header);
+		outCmd.append(pjlink::cmd::version);
+		outCmd.append(cmd);
+		outCmd.append(pjlink::cmd::seperator);
+		outCmd.append(value);
+		outCmd.append(pjlink::terminator);
 	}
 
 
-	PJLinkCommand::PJLinkCommand(const std::string& cmd, const std::string& value)
+	PJLinkCommand::PJLinkCommand(std::string_view cmd, std::string_view value)
 	{
-		mCommand = createCmd(cmd, value);
+		createCmd(mCommand, cmd, value);
+		mPriority = isQuery() ? EPriority::Telemetry : EPriority::Control;
 	}
 
 
-	std::string nap::PJLinkCommand::getResponse() const
+	void PJLinkCommand::setCommandMessage(const std::string& message)
 	{
-		if (mResponse.empty())
-			return "";
-
-		// Get loc of response
-		auto loc = mResponse.find_last_of(pjlink::cmd::equals);
-		assert(loc != std::string::npos);
-
-		// Return substring
-		loc++; assert(loc < mResponse.size());
-		return mResponse.substr(loc, mResponse.size() - loc);
+		mPayload = nullptr;
+		mCommand.clear();
+		mCommand.append(message);
+		mPriority = isQuery() ? EPriority::Telemetry : EPriority::Control;
 	}
 
 
-	std::string nap::PJLinkCommand::getCommand() const
+	void PJLinkCommand::setResponseMessage(const std::string& message)
 	{
-		if (mCommand.empty())
-		{
-			assert(false);
-			return "";
-		}
-
-		auto count = mCommand.size() - sizeof(pjlink::terminator) - 2;
-		assert(mCommand.back() == pjlink::terminator &&  count > 0);
-		return mCommand.substr(2, count);
+		mResponse.assign(message);
+		if (!mResponse.empty())
+			parseResponse();
 	}
 
 
-	PJLinkCommand::EResponseCode nap::PJLinkCommand::getResponseCode() const
+	PJLinkCommandPtr PJLinkCommand::clone() const
 	{
-		// Empty
-		auto response = getResponse();
-		if (response.empty())
-			return PJLinkCommand::EResponseCode::Invalid;
-	
-		// ERROR
-		return utility::startsWith(response, pjlink::cmd::error) ?
-			static_cast<PJLinkCommand::EResponseCode>(response.back()) :
-			PJLinkCommand::EResponseCode::Ok;
-	}
+		// Generic command -> typed copy
+		if (get_type() == RTTI_OF(PJLinkCommand))
+			return std::make_unique<PJLinkCommand>(*this);
 
-
-	nap::PJLinkCommandPtr PJLinkCommand::clone() const
-	{
-		// Create clone
-		assert(this->get_type().can_create_instance());
+		// Custom command that doesn't implement clone() -> copy through RTTI to preserve the type
+		assert(get_type().can_create_instance());
 		auto clone = std::unique_ptr<PJLinkCommand>(get_type().create<PJLinkCommand>());
 		if (clone == nullptr)
 		{
 			assert(false);
 			nap::Logger::error("Failed to clone PJLink command of type: '%s'",
-				this->get_type().get_name().data());
+				get_type().get_name().data());
 			return nullptr;
 		}
 
-		// Copy properties
+		// Copy messages and state, the messages are stored inline and not registered as properties
+		static_cast<PJLinkCommand&>(*clone) = *this;
+
+		// Copy properties of the custom command
 		for (const rtti::Property& property : get_type().get_properties())
 		{
 			rtti::Variant new_value = property.get_value(*this);
@@ -181,109 +182,216 @@ namespace nap
 	}
 
 
-	bool nap::PJLinkSetCommand::success() const
+	void PJLinkCommand::share(std::shared_ptr<const pjlink::Message> payload)
+	{
+		assert(payload != nullptr);
+		mPayload = std::move(payload);
+		mCommand.clear();
+	}
+
+
+	bool nap::PJLinkCommand::isQuery() const
+	{
+		auto command = getMessage().view();
+		return command.size() >= 3 && command[command.size() - 2] == pjlink::cmd::query &&
+			command[command.size() - 3] == pjlink::cmd::seperator;
+	}
+
+
+	std::string_view nap::PJLinkCommand::getResponse() const
+	{
+		if (mResponse.empty())
+			return {};
+
+		// Get loc of response -> malformed when missing, parsed as invalid
+		auto response = mResponse.view();
+		auto loc = response.find_last_of(pjlink::cmd::equals);
+		if (loc == std::string_view::npos)
+			return {};
+
+		// Return substring
+		return response.substr(loc + 1);
+	}
+
+
+	std::string_view nap::PJLinkCommand::getCommand() const
+	{
+		auto command = getMessage().view();
+		if (command.empty())
+		{
+			assert(false);
+			return {};
+		}
+
+		auto count = command.size() - sizeof(pjlink::terminator) - 2;
+		assert(command.back() == pjlink::terminator &&  count > 0);
+		return command.substr(2, count);
+	}
+
+
+	void nap::PJLinkCommand::parseResponse()
 	{
-		return getResponse() == pjlink::cmd::set::ok;
+		// Empty
+		auto response = getResponse();
+		if (response.empty())
+		{
+			mResponseCode = PJLinkCommand::EResponseCode::Invalid;
+		}
+		else
+		{
+			// ERROR
+			mResponseCode = response.compare(0, std::char_traits<char>::length(pjlink::cmd::error), pjlink::cmd::error) == 0 ?
+				static_cast<PJLinkCommand::EResponseCode>(response.back()) :
+				PJLinkCommand::EResponseCode::Ok;
+		}
+
+		// Parse derived fields
+		onParseResponse();
+	}
+
+
+	void nap::PJLinkSetCommand::onParseResponse()
+	{
+		mSuccess = getResponse() == pjlink::cmd::set::ok;
 	}
 
 
 	PJLinkSetInputCommand::PJLinkSetInputCommand(EType type, nap::uint8 number)
 	{
 		assert(number > 0 && number < 10);
-		std::string is;
-		is += static_cast<char>(type);
-		is += static_cast<char>(number + '0');
-		mCommand = createCmd(pjlink::cmd::set::input, is);
+		const char is[] = { static_cast<char>(type), static_cast<char>(number + '0') };
+		createCmd(mCommand, pjlink::cmd::set::input, std::string_view(is, sizeof(is)));
 	}
 
 
-	nap::PJLinkGetPowerCommand::EStatus PJLinkGetPowerCommand::getStatus() const
+	void PJLinkGetPowerCommand::onParseResponse()
 	{
-		switch (this->getResponseCode())
+		switch (getResponseCode())
 		{
 			case PJLinkCommand::EResponseCode::Ok:
-				return static_cast<PJLinkGetPowerCommand::EStatus>(getResponse().back());
+				mStatus = static_cast<PJLinkGetPowerCommand::EStatus>(getResponse().back());
+				break;
 			case PJLinkCommand::EResponseCode::TimeError:
-				return EStatus::TimeError;
+				mStatus = EStatus::TimeError;
+				break;
 			case PJLinkCommand::EResponseCode::ProjectorError:
-				return EStatus::ProjectorError;
+				mStatus = EStatus::ProjectorError;
+				break;
 			default:
-				return EStatus::Unknown;
+				mStatus = EStatus::Unknown;
+				break;
 		}
 	}
 
 
-	nap::PJLinkGetAVMuteCommand::EStatus nap::PJLinkGetAVMuteCommand::getStatus() const
+	void nap::PJLinkGetAVMuteCommand::onParseResponse()
 	{
-		switch (this->getResponseCode())
+		switch (getResponseCode())
 		{
 			case PJLinkCommand::EResponseCode::TimeError:
-				return EStatus::TimeError;
+				mStatus = EStatus::TimeError;
+				break;
 			case PJLinkCommand::EResponseCode::ProjectorError:
-				return EStatus::ProjectorError;
+				mStatus = EStatus::ProjectorError;
+				break;
 			case PJLinkCommand::EResponseCode::Ok:
 			{
 				auto response = getResponse();
 				assert(response.size() == 2);
-				return response.substr(0, 2) == "31" ? EStatus::On : EStatus::Off;
+				mStatus = response.substr(0, 2) == "31" ? EStatus::On : EStatus::Off;
+				break;
 			}
 			default:
-				return EStatus::Unknown;
+				mStatus = EStatus::Unknown;
+				break;
 		}
 	}
 
 
-	int nap::PJLinkGetLampStatusCommand::getHours() const
+	void nap::PJLinkGetLampStatusCommand::onParseResponse()
 	{
-		if (!hasResponse())
-			return -1;
+		mLampCount = 0;
+		if (getResponseCode() != PJLinkCommand::EResponseCode::Ok)
+			return;
 
-		// Multiple lamps could be available, we only support 1
-		// TODO: Support multiple?
-		auto response = getResponse();
-		auto parts = utility::splitString(response, pjlink::cmd::seperator);
-		assert(parts.size() > 1);
-		return stoi(parts[parts.size() - 2]);
+		utility::ErrorState error;
+		if (!decode(getResponse(), mLamps, mLampCount, error))
+		{
+			mLampCount = 0;
+			nap::Logger::error(error.toString());
+		}
 	}
 
 
-	static nap::uint8 createMask(const std::string& response, char check)
+	bool nap::PJLinkGetLampStatusCommand::decode(std::string_view response, Lamps& outLamps, int& outCount, utility::ErrorState& error)
 	{
-		nap::uint8 mask = 0;
-		assert(response.size() == 6);
-		for (auto i = 0; i < response.size(); i++)
-			mask |= response[i] == check ? 0x01U << i : 0x00U;
-		return mask;
+		outCount = 0;
+		const char* it = response.data();
+		const char* end = response.data() + response.size();
+		while (it != end)
+		{
+			if (!error.check(outCount < static_cast<int>(outLamps.size()), "Invalid lamp response, more than %d lamps", static_cast<int>(outLamps.size())))
+				return false;
+
+			// Hours
+			auto& lamp = outLamps[outCount];
+			auto result = std::from_chars(it, end, lamp.mHours);
+			if (!error.check(result.ec == std::errc() && lamp.mHours >= 0, "Invalid lamp response, unable to parse hours of lamp %d", outCount + 1))
+				return false;
+
+			// Separator
+			it = result.ptr;
+			if (!error.check(it != end && *it == pjlink::cmd::seperator, "Invalid lamp response, missing state of lamp %d", outCount + 1))
+				return false;
+
+			// On / Off
+			if (!error.check(++it != end && (*it == '0' || *it == '1'), "Invalid lamp response, invalid state of lamp %d", outCount + 1))
+				return false;
+			lamp.mOn = *it++ == '1';
+			outCount++;
+
+			// Next lamp
+			if (it != end)
+			{
+				if (!error.check(*it == pjlink::cmd::seperator, "Invalid lamp response, missing separator after lamp %d", outCount))
+					return false;
+				it++;
+			}
+		}
+		return error.check(outCount > 0, "Invalid lamp response, no lamps");
 	}
 
 
-	nap::uint16 nap::PJLinkGetErrorStatusCommand::getWarnings() const
+	static nap::uint8 createMask(std::string_view response, char check)
 	{
-		switch (this->getResponseCode())
-		{
-			case PJLinkCommand::EResponseCode::Ok:
-				return createMask(getResponse(), '1');
-			case PJLinkCommand::EResponseCode::TimeError:
-			case PJLinkCommand::EResponseCode::ProjectorError:
-				return static_cast<nap::uint>(PJLinkGetErrorStatusCommand::EStatus::None);
-			default:
-				return (0x01U << 8);
-		}
+		nap::uint8 mask = 0;
+		assert(response.size() == 6);
+		for (size_t i = 0; i < response.size(); i++)
+			mask |= response[i] == check ? 0x01U << i : 0x00U;
+		return mask;
 	}
 
 
-	nap::uint16 nap::PJLinkGetErrorStatusCommand::getErrors() const
+	void nap::PJLinkGetErrorStatusCommand::onParseResponse()
 	{
-		switch (this->getResponseCode())
+		switch (getResponseCode())
 		{
 			case PJLinkCommand::EResponseCode::Ok:
-				return createMask(getResponse(), '2');
+				mWarnings = createMask(getResponse(), '1');
+				mErrors = createMask(getResponse(), '2');
+				break;
 			case PJLinkCommand::EResponseCode::TimeError:
-				return (0x01U << 6);
+				mWarnings = static_cast<nap::uint16>(EStatus::None);
+				mErrors = static_cast<nap::uint16>(EStatus::TimeError);
+				break;
 			case PJLinkCommand::EResponseCode::ProjectorError:
-				return (0x01U << 7);
+				mWarnings = static_cast<nap::uint16>(EStatus::None);
+				mErrors = static_cast<nap::uint16>(EStatus::ProjectorError);
+				break;
 			default:
-				return (0x01U << 8);
+				mWarnings = static_cast<nap::uint16>(EStatus::Unknown);
+				mErrors = static_cast<nap::uint16>(EStatus::Unknown);
+				break;
 		}
 	}
 
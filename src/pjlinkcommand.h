@@ -6,6 +6,12 @@
 
 // External includes
 #include <string>
+#include <string_view>
+#include <array>
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <memory>
 #include <utility/dllexport.h>
 #include <rtti/rttiutilities.h>
 #include <nap/numeric.h>
@@ -55,7 +61,8 @@ namespace nap
 				constexpr const char* power = "POWR";			//< Power query -> 0(off), 1(on), 2(cooling), 3(warming)
 				constexpr const char* avmute = "AVMT";			//< Mute query -> x1(on), x0(off)
 				constexpr const char* error = "ERST";			//< Error status -> 1(fan), 2(lamp), 3(temp), 4(cover), 5(filter), 6(other)
-				constexpr const char* hours = "LAMP";			//< Lamp hours -> x
+				constexpr const char* hours = "LAMP";			//< Lamp hours -> (hours on/off) for every lamp
+				constexpr const size_t lamps = 8;				//< Max number of lamps reported by a projector
 
 			}
 		}
@@ -68,6 +75,79 @@ namespace nap
 				constexpr const char* disabled = "PJLINK 0";	//< projector authentication disabled (required!)
 			}
 		}
+
+
+		/**
+		 * Fixed capacity PJLink message buffer, stored inline.
+		 * Never allocates. Appending content that exceeds the max PJLink message size fails,
+		 * assigned content (for example a received response) is truncated.
+		 */
+		class Message
+		{
+		public:
+			/**
+			 * Replaces the content of the message
+			 * @param content new content
+			 */
+			void assign(std::string_view content)
+			{
+				mSize = std::min(content.size(), mData.size());
+				content.copy(mData.data(), mSize);
+			}
+
+			/**
+			 * Appends content to the message, nothing is appended if it doesn't fit.
+			 * @param content content to append
+			 * @return if the content is appended
+			 */
+			bool append(std::string_view content)
+			{
+				if (content.size() > mData.size() - mSize)
+				{
+					assert(false);
+					return false;
+				}
+				content.copy(mData.data() + mSize, content.size());
+				mSize += content.size();
+				return true;
+			}
+
+			/**
+			 * Appends a single character to the message, nothing is appended if it doesn't fit.
+			 * @param c character to append
+			 * @return if the character is appended
+			 */
+			bool append(char c)								{ return append(std::string_view(&c, 1)); }
+
+			/**
+			 * Clears the message
+			 */
+			void clear()									{ mSize = 0; }
+
+			/**
+			 * @return message characters
+			 */
+			const char* data() const						{ return mData.data(); }
+
+			/**
+			 * @return message byte size
+			 */
+			size_t size() const								{ return mSize; }
+
+			/**
+			 * @return if the message is empty
+			 */
+			bool empty() const								{ return mSize == 0; }
+
+			/**
+			 * @return the message as string view
+			 */
+			std::string_view view() const					{ return { mData.data(), mSize }; }
+
+		private:
+			std::array<char, cmd::size> mData;				//< Message characters
+			size_t mSize = 0;								//< Message size
+		};
 	}
 
 
@@ -77,6 +157,8 @@ namespace nap
 
 	class PJLinkCommand;
 	using PJLinkCommandPtr = std::unique_ptr<PJLinkCommand>;
+	using PJLinkResponsePtr = std::shared_ptr<const PJLinkCommand>;
+	using PJLinkCompletion = std::function<void(const PJLinkResponsePtr&)>;
 
 	/**
 	 * Standard text based PJLink command including response.
@@ -94,11 +176,30 @@ namespace nap
 			ParameterError		= '2',		//< Parameter out of bounds
 			TimeError			= '3',		//< Time issue
 			ProjectorError		= '4',		//< Projector display failure
-			Invalid				= 0x00		//< No response
+			Invalid				= 0x00		//< No or malformed response
+		};
+
+		enum class EState : nap::uint8
+		{
+			Pending				= 0,		//< Command is queued or awaiting response
+			Completed			= 1,		//< Response received
+			ConnectionFailed	= 2,		//< Connection to projector could not be established
+			ConnectionTimedOut	= 3,		//< Connection to projector could not be established in time
+			ConnectionClosed	= 4,		//< Connection closed before a response was received
+			ResponseTimedOut	= 5,		//< No response received in time
+			Dropped				= 6,		//< Removed from the queue before it was sent
+			Rejected			= 7,		//< Not queued, the queue is full
+			CircuitOpen			= 8			//< Not sent, the projector is unreachable and backing off
+		};
+
+		enum class EPriority : nap::uint8
+		{
+			Control				= 0,		//< Written before queued telemetry, default for set commands
+			Telemetry			= 1			//< Written after queued control commands, default for queries
 		};
 
 		// Construct cmd from body and value
-		PJLinkCommand(const std::string& body, const std::string& value);
+		PJLinkCommand(std::string_view body, std::string_view value);
 
 		// Creates an invalid pjlink command
 		PJLinkCommand() = default;
@@ -109,19 +210,74 @@ namespace nap
 		/**
 		 * @return cmd characters
 		 */
-		const char* data()						{ return mCommand.data(); }
+		const char* data() const				{ return getMessage().data(); }
 
 		/**
 		 * @return cmd byte size
 		 */
-		size_t size()							{ return mCommand.size(); }
+		size_t size() const						{ return getMessage().size(); }
+
+		/**
+		 * @return full PJLink command message including header & terminator, as string
+		 */
+		std::string getCommandMessage() const	{ return std::string(getMessage().view()); }
+
+		/**
+		 * Replaces the full PJLink command message, used by scripting.
+		 * The queue priority is derived from the new message: telemetry for queries.
+		 * @param message full PJLink command message including header & terminator
+		 */
+		void setCommandMessage(const std::string& message);
+
+		/**
+		 * @return full PJLink response message including header, as string
+		 */
+		std::string getResponseMessage() const	{ return std::string(mResponse.view()); }
+
+		/**
+		 * Replaces and parses the full PJLink response message, used by scripting
+		 * @param message full PJLink response message including header, excluding terminator
+		 */
+		void setResponseMessage(const std::string& message);
+
+		/**
+		 * @return full PJLink command message including header & terminator, shared or owned
+		 */
+		const pjlink::Message& getMessage() const	{ return mPayload != nullptr ? *mPayload : mCommand; }
+
+		/**
+		 * Sends the given encoded (immutable) message instead of the owned command message.
+		 * Allows many commands to share a single payload, for example when sending to a group of projectors.
+		 * @param payload the encoded command message, must encode a command of this type
+		 */
+		void share(std::shared_ptr<const pjlink::Message> payload);
 
 		/**
 		 * Returns formatted command excluding header, response & terminator.
-		 * Includes only the command body
+		 * Includes only the command body. The view is valid as long as the command is not modified.
 		 * @return projector command
 		 */
-		std::string getCommand() const;
+		std::string_view getCommand() const;
+
+		/**
+		 * @return command class & body, for example: 'POWR'
+		 */
+		std::string_view getBody() const		{ return size() >= 6 ? getMessage().view().substr(2, 4) : std::string_view(); }
+
+		/**
+		 * @return if this command is a query (get) command
+		 */
+		bool isQuery() const;
+
+		/**
+		 * @return command delivery state
+		 */
+		EState getState() const					{ return mState; }
+
+		/**
+		 * @return queue priority of this command
+		 */
+		EPriority getPriority() const			{ return mPriority; }
 
 		/**
 		 * @return if there is a response
@@ -130,24 +286,81 @@ namespace nap
 
 		/**
 		 * Returns formatted response excluding header, command & terminator.
-		 * Includes only the received parameter body.
+		 * Includes only the received parameter body. The view is valid as long as the command is not modified.
+		 * Empty when the response is malformed (no '=' separator), the response code is Invalid in that case.
 		 * @return projector response message
 		 */
-		std::string getResponse() const;
+		std::string_view getResponse() const;
 
 		/**
-		 * Returns response error code
+		 * Returns response error code, available after parsing the response.
 		 * @return Response error code
 		 */
-		EResponseCode getResponseCode() const;
+		EResponseCode getResponseCode() const	{ return mResponseCode; }
+
+		/**
+		 * Parses the response into typed fields.
+		 * Called once by the network thread after receiving a response, 
+		 * all response accessors read the parsed fields and don't allocate.
+		 */
+		void parseResponse();
 
 		/**
-		 * A clone of this command, including all derived properties
+		 * A typed copy of this command, including response.
+		 * Derive custom commands from PJLinkCloneable to implement this function with a typed copy.
+		 * Custom commands that don't, including classes derived from a built-in command, are copied through RTTI:
+		 * this preserves their type but not their unregistered fields.
 		 */
-		PJLinkCommandPtr clone() const;
+		virtual PJLinkCommandPtr clone() const;
+
+		pjlink::Message mCommand;				//< Full PJLink command message, including header & terminator, empty when shared
+		pjlink::Message mResponse;				//< Full PJLink command response, including header, excluding terminator
+		EState mState = EState::Pending;		//< Command delivery state
+		int mTimeout = 0;						//< Max number of seconds to wait for a response, 0 uses projector default
+		EPriority mPriority = EPriority::Control;	//< Queue priority, telemetry for queries by default
+
+	protected:
+		/**
+		 * Override to parse the response into typed fields, called after the response code is parsed.
+		 */
+		virtual void onParseResponse()			{ }
+
+	private:
+		EResponseCode mResponseCode = EResponseCode::Invalid;	//< Parsed response code
+		std::shared_ptr<const pjlink::Message> mPayload;		//< Shared command message, null when owned
+	};
+
 
-		std::string mCommand;					//< Full PJLink command message, including header & terminator
-		std::string mResponse;					//< Full PJLink command response, including header & terminator
+	/**
+	 * Implements PJLinkCommand::clone() for command type T with a typed copy.
+	 * Only commands of exactly type T are copied this way, classes derived from T are copied through RTTI,
+	 * unless they derive from PJLinkCloneable themselves. Derive commands from this helper instead of directly from their base class:
+	 *
+	 * ~~~~~{.cpp}
+	 * class MyCommand : public PJLinkCloneable<MyCommand, PJLinkGetCommand>
+	 * {
+	 *	RTTI_ENABLE(PJLinkGetCommand)
+	 * public:
+	 *	MyCommand() : PJLinkCloneable("INF1") { }
+	 * };
+	 * ~~~~~
+	 */
+	template<typename T, typename Base>
+	class PJLinkCloneable : public Base
+	{
+	public:
+		using Base::Base;
+
+		/**
+		 * @return a typed copy of this command, including response
+		 */
+		PJLinkCommandPtr clone() const override
+		{
+			// Derived from T without implementing clone() -> a copy of T would slice it
+			if (this->get_type() != RTTI_OF(T))
+				return PJLinkCommand::clone();
+			return std::make_unique<T>(static_cast<const T&>(*this));
+		}
 	};
 
 
@@ -156,41 +369,47 @@ namespace nap
 	//////////////////////////////////////////////////////////////////////////
 
 	// Set cmd
-	class NAPAPI PJLinkSetCommand : public PJLinkCommand
+	class NAPAPI PJLinkSetCommand : public PJLinkCloneable<PJLinkSetCommand, PJLinkCommand>
 	{
 		RTTI_ENABLE(PJLinkCommand)
 	public:
-		PJLinkSetCommand(const std::string& body, const std::string& value) :
-			PJLinkCommand(body, value) { }
+		PJLinkSetCommand(std::string_view body, std::string_view value) :
+			PJLinkCloneable(body, value) { }
 
 		PJLinkSetCommand() = default;
 
 		/**
 		 * @return if the projector received and processed the request
 		 */
-		bool success() const;
+		bool success() const							{ return mSuccess; }
+
+	protected:
+		void onParseResponse() override;
+
+	private:
+		bool mSuccess = false;
 	};
 
 
 	// Power on / off
-	class NAPAPI PJLinkSetPowerCommand : public PJLinkSetCommand
+	class NAPAPI PJLinkSetPowerCommand : public PJLinkCloneable<PJLinkSetPowerCommand, PJLinkSetCommand>
 	{
 		RTTI_ENABLE(PJLinkSetCommand)
 	public:
 		PJLinkSetPowerCommand(bool value) :
-			PJLinkSetCommand(pjlink::cmd::set::power, value ? "1" : "0")		{ }
+			PJLinkCloneable(pjlink::cmd::set::power, value ? "1" : "0")		{ }
 
 		PJLinkSetPowerCommand() = default;
 	};
 
 
 	// Mute (av) on / off
-	class NAPAPI PJLinkSetAVMuteCommand : public PJLinkSetCommand
+	class NAPAPI PJLinkSetAVMuteCommand : public PJLinkCloneable<PJLinkSetAVMuteCommand, PJLinkSetCommand>
 	{
 		RTTI_ENABLE(PJLinkSetCommand)
 	public:
 		PJLinkSetAVMuteCommand(bool value) :
-			PJLinkSetCommand(pjlink::cmd::set::avmute, value ? "31" : "30")		{ }
+			PJLinkCloneable(pjlink::cmd::set::avmute, value ? "31" : "30")		{ }
 
 		// Invalid set command
 		PJLinkSetAVMuteCommand() = default;
@@ -198,7 +417,7 @@ namespace nap
 
 
 	// Input selection
-	class NAPAPI PJLinkSetInputCommand : public PJLinkSetCommand
+	class NAPAPI PJLinkSetInputCommand : public PJLinkCloneable<PJLinkSetInputCommand, PJLinkSetCommand>
 	{
 		RTTI_ENABLE(PJLinkSetCommand)
 	public:
@@ -228,12 +447,12 @@ namespace nap
 	//////////////////////////////////////////////////////////////////////////
 
 	// Set cmd
-	class NAPAPI PJLinkGetCommand : public PJLinkCommand
+	class NAPAPI PJLinkGetCommand : public PJLinkCloneable<PJLinkGetCommand, PJLinkCommand>
 	{
 		RTTI_ENABLE(PJLinkCommand)
 	public:
-		PJLinkGetCommand(const std::string& body) :
-			PJLinkCommand(body, std::string(1, pjlink::cmd::query))	{ }
+		PJLinkGetCommand(std::string_view body) :
+			PJLinkCloneable(body, std::string_view(&pjlink::cmd::query, 1))	{ }
 
 		// Invalid get command
 		PJLinkGetCommand() = default;
@@ -241,7 +460,7 @@ namespace nap
 
 
 	// Get power status
-	class NAPAPI PJLinkGetPowerCommand : public PJLinkGetCommand
+	class NAPAPI PJLinkGetPowerCommand : public PJLinkCloneable<PJLinkGetPowerCommand, PJLinkGetCommand>
 	{
 		RTTI_ENABLE(PJLinkGetCommand)
 	public:
@@ -257,17 +476,23 @@ namespace nap
 		};
 
 		PJLinkGetPowerCommand() :
-			PJLinkGetCommand(pjlink::cmd::get::power)		{ }
+			PJLinkCloneable(pjlink::cmd::get::power)		{ }
 
 		/**
 		 * @return power status
 		 */
-		EStatus getStatus() const;
+		EStatus getStatus() const						{ return mStatus; }
+
+	protected:
+		void onParseResponse() override;
+
+	private:
+		EStatus mStatus = EStatus::Unknown;
 	};
 
 
 	// Get mute status
-	class NAPAPI PJLinkGetAVMuteCommand : public PJLinkGetCommand
+	class NAPAPI PJLinkGetAVMuteCommand : public PJLinkCloneable<PJLinkGetAVMuteCommand, PJLinkGetCommand>
 	{
 		RTTI_ENABLE(PJLinkGetCommand)
 	public:
@@ -281,32 +506,75 @@ namespace nap
 		};
 
 		PJLinkGetAVMuteCommand() :
-			PJLinkGetCommand(pjlink::cmd::get::avmute)		{ }
+			PJLinkCloneable(pjlink::cmd::get::avmute)		{ }
 
 		/**
 		 * @return av mute status
 		 */
-		EStatus getStatus() const;
+		EStatus getStatus() const						{ return mStatus; }
+
+	protected:
+		void onParseResponse() override;
+
+	private:
+		EStatus mStatus = EStatus::Unknown;
 	};
 
 
 	// Get lamp status
-	class NAPAPI PJLinkGetLampStatusCommand : public PJLinkGetCommand
+	class NAPAPI PJLinkGetLampStatusCommand : public PJLinkCloneable<PJLinkGetLampStatusCommand, PJLinkGetCommand>
 	{
 		RTTI_ENABLE(PJLinkGetCommand)
 	public:
 		PJLinkGetLampStatusCommand() :
-			PJLinkGetCommand(pjlink::cmd::get::hours)		{ }
+			PJLinkCloneable(pjlink::cmd::get::hours)		{ }
+
+		// Status of a single lamp
+		struct Lamp
+		{
+			int mHours = -1;							//< Total number of lamp hours
+			bool mOn = false;							//< If the lamp is on
+		};
+		using Lamps = std::array<Lamp, pjlink::cmd::get::lamps>;
+
+		/**
+		 * Total number of hours of the first lamp, -1 if response is invalid
+		 */
+		int getHours() const							{ return mLampCount > 0 ? mLamps[0].mHours : -1; }
+
+		/**
+		 * @return number of lamps, 0 if response is invalid
+		 */
+		int getLampCount() const						{ return mLampCount; }
 
 		/**
-		 * Total number of hours, -1 if response is invalid
+		 * @param index lamp index, must be lower than getLampCount()
+		 * @return status of the lamp at the given index
 		 */
-		int getHours() const;
+		const Lamp& getLamp(int index) const			{ assert(index >= 0 && index < mLampCount); return mLamps[index]; }
+
+		/**
+		 * Decodes a lamp status response body ('hours on/off' for every lamp). 
+		 * Does not allocate or throw, unless decoding fails.
+		 * @param response the response body
+		 * @param outLamps the decoded lamps
+		 * @param outCount number of decoded lamps
+		 * @param error contains the error if decoding fails
+		 * @return if decoding succeeded
+		 */
+		static bool decode(std::string_view response, Lamps& outLamps, int& outCount, utility::ErrorState& error);
+
+	protected:
+		void onParseResponse() override;
+
+	private:
+		Lamps mLamps;
+		int mLampCount = 0;
 	};
 
 
 	// Get error status
-	class NAPAPI PJLinkGetErrorStatusCommand : public PJLinkGetCommand
+	class NAPAPI PJLinkGetErrorStatusCommand : public PJLinkCloneable<PJLinkGetErrorStatusCommand, PJLinkGetCommand>
 	{
 		RTTI_ENABLE(PJLinkGetCommand)
 	public:
@@ -325,13 +593,13 @@ namespace nap
 		};
 
 		PJLinkGetErrorStatusCommand() :
-			PJLinkGetCommand(pjlink::cmd::get::error)		{ }
+			PJLinkCloneable(pjlink::cmd::get::error)		{ }
 
 		/**
 		 * Return warning bitmask
 		 * @return warning bitmask
 		 */
-		nap::uint16 getWarnings() const;
+		nap::uint16 getWarnings() const						{ return mWarnings; }
 
 		/**
 		 * @return all errors as ', ' separated string
@@ -342,7 +610,7 @@ namespace nap
 		 * Return error bitmask
 		 * @return error bitmask
 		 */
-		nap::uint16 getErrors() const;
+		nap::uint16 getErrors() const						{ return mErrors; }
 
 		/**
 		 * @return all errors as ', ' separated string
@@ -367,5 +635,12 @@ namespace nap
 		 * @return if error is present for given bit
 		 */
 		bool getError(EStatus status) const					{ return (getErrors() & static_cast<nap::uint>(status)) > 0; }
+
+	protected:
+		void onParseResponse() override;
+
+	private:
+		nap::uint16 mWarnings = static_cast<nap::uint16>(EStatus::Unknown);
+		nap::uint16 mErrors = static_cast<nap::uint16>(EStatus::Unknown);
 	};
 }
@@ -2,10 +2,12 @@
 
 // External Includes
 #include <entity.h>
+#include <nap/logger.h>
 
 // nap::pjlinkcomponent run time class definition 
 RTTI_BEGIN_CLASS(nap::PJLinkComponent)
 	RTTI_PROPERTY("Projector", &nap::PJLinkComponent::mProjector,  nap::rtti::EPropertyMetaData::Required, "Projector Client Connection")
+	RTTI_PROPERTY("QueueSize", &nap::PJLinkComponent::mQueueSize,  nap::rtti::EPropertyMetaData::Default, "Max number of responses buffered in between updates")
 RTTI_END_CLASS
 
 // nap::pjlinkcomponentInstance run time class definition 
@@ -20,37 +22,42 @@ namespace nap
 {
 	bool PJLinkComponentInstance::init(utility::ErrorState& errorState)
 	{
-		// Listen for changes
+		// Preallocate response queue
 		auto resource = getComponent<PJLinkComponent>();
+		if (!errorState.check(resource->mQueueSize > 0, "%s: invalid queue size: %d", resource->mID.c_str(), resource->mQueueSize))
+			return false;
+		mQueue = std::make_unique<pjlink::BoundedQueue<PJLinkResponsePtr>>(resource->mQueueSize);
+
+		// Listen for changes
 		mProjector = resource->mProjector.get();
-		mProjector->responseReceived.connect(mResponseSlot);
+		mProjector->sharedResponseReceived.connect(mResponseSlot);
 
 		return true;
 	}
 
 
-	void PJLinkComponentInstance::onResponse(const PJLinkCommand& cmd)
+	void PJLinkComponentInstance::onResponse(const PJLinkResponsePtr& cmd)
 	{
-		auto clone = cmd.clone(); assert(clone != nullptr);
-		std::lock_guard<std::mutex> lock(mMutex);
-		mrQueue.emplace(std::move(clone));
+		// Response is immutable -> share instead of copy
+		auto response = cmd;
+		if (!mQueue->push(std::move(response)))
+			mDropped++;
 	}
 
 
 	void PJLinkComponentInstance::update(double deltaTime)
 	{
-		// Swap messages thread-safe
+		// Report dropped messages
+		auto dropped = mDropped.exchange(0);
+		if (dropped > 0)
 		{
-			std::lock_guard<std::mutex> lock(mMutex);
-			assert(mcQueue.empty());
-			mrQueue.swap(mcQueue);
+			nap::Logger::warn("%s: Response queue full, dropped %d response(s)",
+				getComponent<PJLinkComponent>()->mID.c_str(), static_cast<int>(dropped));
 		}
 
-		// Consume messages
-		while (!mcQueue.empty())
-		{
-			messageReceived(*this, *mcQueue.front());
-			mcQueue.pop();
-		}
+		// Consume messages -> bound by capacity, a response storm can't stall the frame
+		PJLinkResponsePtr response;
+		for (size_t i = 0; i < mQueue->capacity() && mQueue->pop(response); i++)
+			messageReceived(*this, *response);
 	}
 }
@@ -6,10 +6,10 @@
 
 // Local includes
 #include "pjlinkprojector.h"
+#include "pjlinkqueue.h"
 
 // External includes
 #include <component.h>
-#include <mutex>
 
 namespace nap
 {
@@ -24,6 +24,7 @@ namespace nap
 		DECLARE_COMPONENT(PJLinkComponent, PJLinkComponentInstance)
 	public:
 		nap::ResourcePtr<PJLinkProjector> mProjector;			///< Property: 'Projector' Projector client connection
+		int mQueueSize = 256;									///< Property: 'QueueSize' Max number of responses buffered in between updates, additional responses are dropped
 	};
 
 
@@ -32,6 +33,7 @@ namespace nap
 	 * 
 	 * Register to the messageReceived signal to receive projector messages.
 	 * The signal is invoked on the main (application) thread, on update() of this component.
+	 * Responses are handed over using a bounded lock-free queue, responses are dropped when the queue is full.
 	 */
 	class NAPAPI PJLinkComponentInstance : public ComponentInstance
 	{
@@ -68,10 +70,9 @@ namespace nap
 		nap::PJLinkProjector* mProjector = nullptr;
 
 		// Called from pjlink event thread
-		void onResponse(const PJLinkCommand&);
-		nap::Slot<const PJLinkCommand&> mResponseSlot = { this, &PJLinkComponentInstance::onResponse };
-		std::queue<PJLinkCommandPtr> mrQueue;
-		std::queue<PJLinkCommandPtr> mcQueue;
-		std::mutex mMutex;
+		void onResponse(const PJLinkResponsePtr&);
+		nap::Slot<const PJLinkResponsePtr&> mResponseSlot = { this, &PJLinkComponentInstance::onResponse };
+		std::unique_ptr<pjlink::BoundedQueue<PJLinkResponsePtr>> mQueue;		//< Responses received from network thread
+		std::atomic<nap::uint64> mDropped = { 0 };								//< Number of responses dropped since last update
 	};
 }
@@ -12,8 +12,17 @@
 #include <asio/connect.hpp>
 #include <asio/read_until.hpp>
 #include <asio/write.hpp>
-#include <asio/use_future.hpp>
+#include <asio/post.hpp>
 #include <asio/defer.hpp>
+#include <asio/bind_executor.hpp>
+
+#ifdef ASIO_HAS_CO_AWAIT
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/use_awaitable.hpp>
+#endif // ASIO_HAS_CO_AWAIT
 
 using namespace asio::ip;
 
@@ -26,102 +35,359 @@ namespace nap
 	constexpr int abortec = 125;
 #endif
 
-	PJLinkConnection::PJLinkConnection(pjlink::Context& context, const asio::ip::address& address, PJLinkProjector& projector) :
-		mSocket(context),
-		mProjector(projector),
-		mAddress(address)
+	/**
+	 * Returns if the response belongs to the given command -> compares class & body.
+	 * Used to discard late replies of commands that timed out.
+	 */
+	static bool isReply(std::string_view command, std::string_view response)
+	{
+		constexpr size_t len = 6;
+		return command.size() >= len && response.size() >= len &&
+			response.compare(1, len - 1, command, 1, len - 1) == 0;
+	}
+
+
+	/**
+	 * Returns if both commands share the same class & body
+	 */
+	static bool isSameBody(std::string_view a, std::string_view b)
+	{
+		constexpr size_t len = 6;
+		return a.size() >= len && b.size() >= len && a.compare(1, len - 1, b, 1, len - 1) == 0;
+	}
+
+
+	PJLinkCompletion pjlink::chain(PJLinkCompletion first, PJLinkCompletion second)
+	{
+		if (!first)
+			return second;
+		if (!second)
+			return first;
+		return [first = std::move(first), second = std::move(second)](const PJLinkResponsePtr& response)
+		{
+			first(response);
+			second(response);
+		};
+	}
+
+
+	bool pjlink::coroutinesSupported()
+	{
+#ifdef ASIO_HAS_CO_AWAIT
+		return true;
+#else
+		return false;
+#endif // ASIO_HAS_CO_AWAIT
+	}
+
+
+#ifdef ASIO_HAS_CO_AWAIT
+	/**
+	 * Connection session driven by a single coroutine
+	 */
+	struct PJLinkConnection::Session
+	{
+		// Awaitable bound to the connection strand -> operations don't allocate a type erased executor
+		using Awaitable = asio::awaitable<void, pjlink::Strand>;
+
+		// Connects, authenticates and writes commands until closed, the handle is the only lifetime anchor
+		static Awaitable run(std::shared_ptr<PJLinkConnection> handle);
+	};
+#endif // ASIO_HAS_CO_AWAIT
+
+
+	PJLinkConnection::PJLinkConnection(pjlink::Context& context) :
+		mStrand(asio::make_strand(context)),
+		mSocket(mStrand),
+		mCmds(Requests::allocator_type(mQueueMemory)),
+		mIdleDeadline(mStrand),
+		mResponseDeadline(mStrand),
+		mResponseMemory(std::make_shared<ResponseMemory>())
 	{ }
 
 
-	std::shared_ptr<nap::PJLinkConnection> PJLinkConnection::create(pjlink::Context& context, const asio::ip::address& address, PJLinkProjector& projector)
+	nap::uint64 PJLinkConnection::getFallbackCount() const
 	{
-		return std::shared_ptr<PJLinkConnection>(
-			new PJLinkConnection(context, address, projector)
-		);
+		return mQueueMemory.getFallbackCount() + mIdleDeadline.mMemory.getFallbackCount() +
+			mResponseDeadline.mMemory.getFallbackCount() + mReadMemory.getFallbackCount() +
+			mWriteMemory.getFallbackCount() + mPostMemory.getFallbackCount() +
+			mResponseMemory->getFallbackCount() + mPromiseMemory.getFallbackCount();
 	}
 
 
-	std::future<bool> PJLinkConnection::connect()
+	void PJLinkConnection::reset(PJLinkProjector& projector)
 	{
-		mEndpoint = tcp::endpoint(mAddress, pjlink::port);
+		// Bind to projector -> endpoint is parsed once on projector initialization
+		mProjector = &projector;
+		mEndpoint = projector.mEndpoint;
+
+		// Close socket of previous use, keep buffer storage
+		std::error_code ec;
+		if (mSocket.is_open())
+			mSocket.close(ec);
+		mAuthBuffer.consume(mAuthBuffer.size());
+		mRespBuffer.consume(mRespBuffer.size());
+
+		// No handlers are outstanding when recycled -> reset state
+		assert(mCmds.empty());
+		mCmds.clear();
+		cancelDeadline(mIdleDeadline);
+		cancelDeadline(mResponseDeadline);
+		mReady = false;
+		mDepth = 0;
+		mHeartbeat = false;
+		mKeptAlive = false;
+		mWriting = false;
+		mWritePending = false;
+		mAwaiting = false;
+		mReported = false;
+		mClosed = false;
+
+		// Release the previous result before creating a new one -> the result state is allocated from recycled memory
+		mConnectFuture = std::shared_future<bool>();
+		{
+			auto previous = std::move(mConnected);
+		}
+		mConnected = std::promise<bool>(std::allocator_arg, pjlink::HandlerAllocator<char, decltype(mPromiseMemory)>(mPromiseMemory));
+	}
+
+
+	std::shared_future<bool> PJLinkConnection::connect()
+	{
+		mConnectFuture = mConnected.get_future().share();
+
+		// Cancel connection attempt when it isn't established in time, the timeout is validated on projector init
+		assert(mProjector->mConnectTimeout > 0);
+		setTimer(nap::Seconds(mProjector->mConnectTimeout));
+
+#ifdef ASIO_HAS_CO_AWAIT
+		// Run session as coroutine
+		if (mProjector->mCoroutines)
+		{
+			asio::co_spawn(mStrand, Session::run(shared_from_this()), asio::detached);
+			return mConnectFuture;
+		}
+#endif // ASIO_HAS_CO_AWAIT
+
+		// Explicitly bound to the strand -> the handler must never run concurrently with other handlers of this connection.
+		// The connect operation precedes the first read and shares its memory.
 		auto handle = shared_from_this();
-		auto cf = mSocket.async_connect(mEndpoint, asio::use_future([handle](std::error_code ec)
+		mSocket.async_connect(mEndpoint, asio::bind_executor(mStrand, pjlink::makeHandler(mReadMemory, [handle](std::error_code ec)
 			{
 				// Handle error
 				if (ec)
 				{
-					nap::Logger::error("Failed (ec '%d') to connect to endpoint: %s, port: %d",
-						ec.value(),
-						handle->mAddress.to_string().c_str(),
-						handle->mEndpoint.port());
+					if (ec.value() != abortec)
+					{
+						nap::Logger::error("Failed (ec '%d') to connect to endpoint: %s, port: %d",
+							ec.value(),
+							handle->mProjector->mIPAddress.c_str(),
+							handle->mEndpoint.port());
+					}
 
-					// Notify listeners explicitly here -> otherwise on close
-					handle->mProjector.connectionClosed();
-					return false;
+					// Fail enqueued commands and notify listeners
+					handle->connectFailed(PJLinkCommand::EState::ConnectionFailed);
+					return;
 				}
 
 				// Connection success -> verify authentification
 				nap::Logger::debug("%s: Connected, port: %d",
-					handle->mAddress.to_string().c_str(),
+					handle->mProjector->mIPAddress.c_str(),
 					handle->mEndpoint.port());
 
-				// Authentication failed
-				if (!handle->authenticate())
-					return false;
+				handle->authenticate();
+			})));
+		return mConnectFuture;
+	}
 
-				// Write enqueued cmd
-				handle->setTimer();
-				if (!handle->mCmds.empty())
-					handle->write(*(handle->mCmds.front()));
 
-				// Start reading callback
-				handle->read();
+#ifdef ASIO_HAS_CO_AWAIT
+	PJLinkConnection::Session::Awaitable PJLinkConnection::Session::run(std::shared_ptr<PJLinkConnection> handle)
+	{
+		auto& connection = *handle;
+		std::error_code ec;
+		auto token = asio::redirect_error(asio::use_awaitable_t<pjlink::Strand>(), ec);
 
-				// Return reference to self as future
-				return false;
-			}));
-		return cf;
+		// Disconnected before the session started -> don't connect
+		if (connection.mClosed)
+		{
+			connection.mConnected.set_value(false);
+			co_return;
+		}
+
+		// Connect -> cancelled by the connect deadline
+		co_await connection.mSocket.async_connect(connection.mEndpoint, token);
+		if (ec)
+		{
+			if (ec.value() != abortec)
+			{
+				nap::Logger::error("Failed (ec '%d') to connect to endpoint: %s, port: %d",
+					ec.value(), connection.mProjector->mIPAddress.c_str(), connection.mEndpoint.port());
+			}
+			connection.connectFailed(PJLinkCommand::EState::ConnectionFailed);
+			co_return;
+		}
+		nap::Logger::debug("%s: Connected, port: %d", connection.mProjector->mIPAddress.c_str(), connection.mEndpoint.port());
+
+		// Read authentication header -> cancelled by the authentication deadline
+		connection.setTimer(nap::Seconds(sAuthTimeout));
+		auto size = co_await asio::async_read_until(connection.mSocket, connection.mAuthBuffer, pjlink::terminator, token);
+		if (ec)
+		{
+			nap::Logger::error("Failed (ec '%d') to authorize projector at endpoint: %s",
+				ec.value(), connection.mProjector->mIPAddress.c_str());
+			connection.connectFailed(PJLinkCommand::EState::ConnectionFailed);
+			co_return;
+		}
+
+		if (!connection.verify(size))
+		{
+			connection.connectFailed(PJLinkCommand::EState::ConnectionFailed);
+			co_return;
+		}
+
+		connection.mReady = true;
+		connection.setTimer(nap::Seconds(sTimeout));
+		connection.reportResult(true);
+		connection.mConnected.set_value(true);
+
+		// Write commands one by one, the next command is written after receiving a response.
+		// The session ends when the connection is closed.
+		while (connection.mSocket.is_open())
+		{
+			// Wait for a command -> woken up by enqueue, keep-alive or close
+			if (connection.mCmds.empty())
+			{
+				connection.mSignal.expires_at(pjlink::Timer::time_point::max());
+				co_await connection.mSignal.async_wait(token);
+				continue;
+			}
+
+			// Copy into connection owned buffer -> the command can complete (time out) while it is being written
+			auto& cmd = *connection.mCmds.front().mCommand;
+			connection.mWriteBuffer = cmd.getMessage();
+
+			// Write command -> the response deadline completes the command when it passes, it never cancels the write
+			auto timeout = cmd.mTimeout > 0 ? cmd.mTimeout : connection.mProjector->mResponseTimeout;
+			connection.setDeadline(connection.mResponseDeadline, nap::Seconds(timeout), &PJLinkConnection::responseTimeout);
+			connection.mAwaiting = true;
+			connection.mWriting = true;
+
+			auto write_buffer = asio::buffer(connection.mWriteBuffer.data(), connection.mWriteBuffer.size());
+			size = co_await asio::async_write(connection.mSocket, write_buffer, token);
+			connection.mWriting = false;
+			if (ec)
+			{
+				if (ec.value() != abortec)
+				{
+					nap::Logger::error("Writing failed (ec '%d'), projector endpoint: %s",
+						ec.value(), connection.mProjector->mIPAddress.c_str());
+				}
+				connection.close();
+				co_return;
+			}
+			nap::Logger::debug("%s: Written %d byte(s)", connection.mProjector->mIPAddress.c_str(), static_cast<int>(size));
+
+			// Read until the response arrives or the command timed out, skipped when it timed out while writing
+			while (connection.mAwaiting)
+			{
+				size = co_await asio::async_read_until(connection.mSocket, connection.mRespBuffer, pjlink::terminator, token);
+				if (ec)
+				{
+					// Read cancelled by the response deadline -> continue with next command
+					if (ec.value() == abortec && connection.mSocket.is_open() && !connection.mAwaiting)
+						break;
+
+					if (ec.value() != abortec)
+					{
+						nap::Logger::error("Reading failed (ec '%d'), projector endpoint: %s,\nmsg: %s",
+							ec.value(), connection.mProjector->mIPAddress.c_str(), ec.message().c_str());
+					}
+					connection.close();
+					co_return;
+				}
+
+				// Command timed out while the response was read -> late response
+				if (!connection.mAwaiting)
+				{
+					connection.mRespBuffer.consume(size);
+					break;
+				}
+				connection.mAwaiting = !connection.reply(size);
+			}
+		}
 	}
+#endif // ASIO_HAS_CO_AWAIT
 
 
 	std::future<void> PJLinkConnection::disconnect()
 	{
-		// Schedule task to close socket when connected
-		auto handle = shared_from_this();
-		auto f = asio::post(mSocket.get_executor(), asio::use_future([handle]
+		// Schedule task to close socket when connected, the result state is allocated from recycled memory
+		std::promise<void> closed(std::allocator_arg, pjlink::HandlerAllocator<char, decltype(mPromiseMemory)>(mPromiseMemory));
+		auto f = closed.get_future();
+		asio::post(mSocket.get_executor(), pjlink::makeHandler(mPostMemory, [handle = shared_from_this(), closed = std::move(closed)]() mutable
 			{
+				// Explicit disconnect -> an interrupted connection attempt isn't a failure
+				handle->mReported = true;
 				handle->close();
+				closed.set_value();
 			}
 		));
 		return f;
 	}
 
 
-	bool PJLinkConnection::authenticate()
+	void PJLinkConnection::authenticate()
 	{
-		std::error_code ec;
-		auto size = asio::read_until(mSocket, mAuthBuffer, pjlink::terminator, ec);
-		if (ec)
-		{
-			nap::Logger::error("Failed (ec '%d') to authorize projector at endpoint: %s",
-				ec.value(), mAddress.to_string().c_str());
+		// Close the connection when the authentication header isn't received in time
+		setTimer(nap::Seconds(sAuthTimeout));
 
-			close();
-			return false;
-		}
+		// Read authentication header a-sync -> a stuck device only stalls itself
+		auto handle = shared_from_this();
+		asio::async_read_until(mSocket, mAuthBuffer, pjlink::terminator, pjlink::makeHandler(mReadMemory, [handle](std::error_code ec, std::size_t size)
+			{
+				if (ec)
+				{
+					nap::Logger::error("Failed (ec '%d') to authorize projector at endpoint: %s",
+						ec.value(), handle->mProjector->mIPAddress.c_str());
+
+					handle->connectFailed(PJLinkCommand::EState::ConnectionFailed);
+					return;
+				}
+
+				// Ensure authentication is disabled
+				if (!handle->verify(size))
+				{
+					handle->connectFailed(PJLinkCommand::EState::ConnectionFailed);
+					return;
+				}
 
+				// Write enqueued cmd
+				handle->mReady = true;
+				handle->setTimer(nap::Seconds(sTimeout));
+				if (!handle->mCmds.empty())
+					handle->next();
+
+				// Start reading callback
+				handle->read();
+				handle->reportResult(true);
+				handle->mConnected.set_value(true);
+			}));
+	}
+
+
+	bool PJLinkConnection::verify(std::size_t size)
+	{
 		// Commit to string
-		nap::Logger::debug("%s: Received %d authorization bytes", mAddress.to_string().c_str(), size);
-		std::istream is(&mAuthBuffer); std::string response;
+		nap::Logger::debug("%s: Received %d authorization bytes", mProjector->mIPAddress.c_str(), size);
+		std::string response;
 		std::getline(std::istream(&mAuthBuffer), response, pjlink::terminator);
 
 		// Ensure it's an authentication header
 		if (!utility::startsWith(response, pjlink::response::authenticate::header, false))
 		{
 			nap::Logger::error("Projector '%s' authentication failed, invalid response: %s",
-				mAddress.to_string().c_str(), response.c_str());
-
-			close();
+				mProjector->mIPAddress.c_str(), response.c_str());
 			return false;
 		}
 
@@ -129,62 +395,246 @@ namespace nap
 		if (!utility::startsWith(response, pjlink::response::authenticate::disabled, false))
 		{
 			nap::Logger::error("Projector authentication requested -> not supported, \
-						disable authentication at endpoint: %s",
-				mAddress.to_string().c_str());
-
-			close();
-			return true;
+				disable authentication at endpoint: %s",
+				mProjector->mIPAddress.c_str());
+			return false;
 		}
 
 		// All good
-		nap::Logger::debug("%s: Authentication succeeded",
-			mAddress.to_string().c_str());
-
-		mReady = true;
+		nap::Logger::debug("%s: Authentication succeeded", mProjector->mIPAddress.c_str());
 		return true;
 	}
 
 
-	void PJLinkConnection::enqueue(PJLinkCommandPtr command)
+	bool PJLinkConnection::enqueue(PJLinkCommandPtr& command, PJLinkCompletion& completion)
 	{
+		// Reserve a slot -> refuse when the queue is full and the policy is to reject
+		int max_depth = mProjector->mMaxQueueDepth;
+		if (max_depth > 0 && mProjector->mQueuePolicy == PJLinkProjector::EQueuePolicy::Reject)
+		{
+			int depth = mDepth.load();
+			do
+			{
+				if (depth >= max_depth)
+					return false;
+			} while (!mDepth.compare_exchange_weak(depth, depth + 1));
+		}
+		else
+		{
+			mDepth++;
+		}
+
 		// Submit task for execution -> it is queued and called from the socket execution thread
 		auto handle = shared_from_this();
-		asio::post(mSocket.get_executor(), [handle, cmd = std::move(command)]() mutable
+		asio::post(mSocket.get_executor(), pjlink::makeHandler(mPostMemory, [handle, request = Request{ std::move(command), std::move(completion) }]() mutable
 			{
+				// Connection closed before the command could be queued -> fail
+				if (handle->mClosed)
+				{
+					handle->mDepth--;
+					handle->complete(request, PJLinkCommand::EState::ConnectionClosed);
+					return;
+				}
+
+				// Merge with pending command if possible
+				if (handle->mProjector->mCoalesce && handle->coalesce(request))
+				{
+					handle->mDepth--;
+					handle->mProjector->mCoalesced++;
+					return;
+				}
+
+				// Queue is full and there's nothing to drop -> reject, only reported through the completion
+				if (!handle->limitDepth())
+				{
+					handle->mDepth--;
+					handle->mProjector->mRejected++;
+					handle->complete(request, PJLinkCommand::EState::Rejected);
+					return;
+				}
+
 				// We only write if the queue is empty -> when all cmds have been processed.
 				// PJLink requires cmds to be sent in order, one by one, after a valid response.
 				// The recursive read callback handles further cmd processing, after a response.
 				bool queue_empty = handle->mCmds.empty();
-				handle->mCmds.emplace(std::move(cmd));
+				handle->insert(std::move(request));
+
+				// Command is sent over a connection that was kept alive -> reconnect saved
+				if (handle->mKeptAlive)
+				{
+					handle->mKeptAlive = false;
+					handle->mProjector->mReconnectsSaved++;
+				}
+
 				if (handle->mReady && queue_empty)
 				{
-					handle->write(*(handle->mCmds.front()));
+					handle->next();
 				}
-			}
+			})
 		);
+		return true;
+	}
+
+
+	PJLinkConnection::Requests::iterator PJLinkConnection::pending()
+	{
+		// The command in front has been written when the connection is ready
+		return mReady && !mCmds.empty() ? mCmds.begin() + 1 : mCmds.begin();
+	}
+
+
+	void PJLinkConnection::insert(Request&& request)
+	{
+		// Telemetry is queued at the back
+		if (request.mCommand->getPriority() == PJLinkCommand::EPriority::Telemetry)
+		{
+			mCmds.emplace_back(std::move(request));
+			limitTelemetry();
+			return;
+		}
+
+		// Control is queued after pending control commands, in front of pending telemetry
+		auto it = std::find_if(pending(), mCmds.end(), [](const Request& pending)
+			{
+				return pending.mCommand->getPriority() == PJLinkCommand::EPriority::Telemetry;
+			});
+		mCmds.emplace(it, std::move(request));
+	}
+
+
+	void PJLinkConnection::limitTelemetry()
+	{
+		if (mProjector->mMaxTelemetry <= 0)
+			return;
+
+		auto first = pending();
+		auto count = std::count_if(first, mCmds.end(), [](const Request& pending)
+			{
+				return pending.mCommand->getPriority() == PJLinkCommand::EPriority::Telemetry;
+			});
+		if (count <= mProjector->mMaxTelemetry)
+			return;
+
+		// Drop oldest pending telemetry
+		auto it = std::find_if(first, mCmds.end(), [](const Request& pending)
+			{
+				return pending.mCommand->getPriority() == PJLinkCommand::EPriority::Telemetry;
+			});
+		assert(it != mCmds.end());
+		drop(it, PJLinkCommand::EState::Dropped);
+	}
+
+
+	bool PJLinkConnection::limitDepth()
+	{
+		// Rejection is handled before the request is posted
+		int max_depth = mProjector->mMaxQueueDepth;
+		if (max_depth <= 0 || mProjector->mQueuePolicy == PJLinkProjector::EQueuePolicy::Reject)
+			return true;
+
+		// Room for the request -> keep-alive doesn't count
+		int queued = static_cast<int>(mCmds.size()) - (mHeartbeat ? 1 : 0);
+		if (queued < max_depth)
+			return true;
+
+		// Find pending command to drop according to policy
+		auto first = pending();
+		auto it = first;
+		if (mProjector->mQueuePolicy == PJLinkProjector::EQueuePolicy::DropTelemetry)
+		{
+			it = std::find_if(first, mCmds.end(), [](const Request& pending)
+				{
+					return pending.mCommand->getPriority() == PJLinkCommand::EPriority::Telemetry;
+				});
+		}
+
+		if (it == mCmds.end())
+			return false;
+
+		drop(it, PJLinkCommand::EState::Dropped);
+		return true;
+	}
+
+
+	void PJLinkConnection::drop(Requests::iterator it, PJLinkCommand::EState state)
+	{
+		auto dropped = std::move(*it);
+		mCmds.erase(it);
+		mDepth--;
+		mProjector->mDropped++;
+		complete(dropped, state);
+	}
+
+
+	bool PJLinkConnection::coalesce(Request& request)
+	{
+		// Only consider the most recent pending command with the same body
+		auto cmd = request.mCommand->getMessage().view();
+		auto first = pending();
+		for (auto it = mCmds.end(); it != first; )
+		{
+			--it;
+			auto pending = it->mCommand->getMessage().view();
+			if (!isSameBody(cmd, pending))
+				continue;
+
+			// Duplicate query -> merge into single request
+			if (request.mCommand->isQuery())
+			{
+				if (pending != cmd)
+					return false;
+				it->mCompletion = pjlink::chain(std::move(it->mCompletion), std::move(request.mCompletion));
+				return true;
+			}
+
+			// Set command -> replaces the pending set command
+			if (it->mCommand->isQuery())
+				return false;
+			it->mCommand = std::move(request.mCommand);
+			it->mCompletion = pjlink::chain(std::move(it->mCompletion), std::move(request.mCompletion));
+			return true;
+		}
+		return false;
 	}
 
 
 	void PJLinkConnection::write(PJLinkCommand& cmd)
 	{
-		assert(mSocket.is_open() && mReady);
-		auto write_buffer = asio::buffer(cmd.data(), cmd.size());
+		// Copy into connection owned buffer -> the command can complete (time out) while it is being written
+		assert(mSocket.is_open() && mReady && !mWriting);
+		mWriteBuffer = cmd.getMessage();
+		auto write_buffer = asio::buffer(mWriteBuffer.data(), mWriteBuffer.size());
 		auto handle = shared_from_this();
-		asio::async_write(mSocket, write_buffer, [handle](std::error_code ec, std::size_t size)
+
+		// Start response deadline -> command specific or projector default
+		auto timeout = cmd.mTimeout > 0 ? cmd.mTimeout : mProjector->mResponseTimeout;
+		setDeadline(mResponseDeadline, nap::Seconds(timeout), &PJLinkConnection::responseTimeout);
+
+		mWriting = true;
+		asio::async_write(mSocket, write_buffer, pjlink::makeHandler(mWriteMemory, [handle](std::error_code ec, std::size_t size)
 			{
 				// Writing failed
+				handle->mWriting = false;
 				if (ec)
 				{
 					nap::Logger::error("Writing failed (ec '%d'), projector endpoint: %s",
-						ec.value(), handle->mAddress.to_string().c_str());
+						ec.value(), handle->mProjector->mIPAddress.c_str());
 
 					handle->close();
 					return;
 				}
 
 				// Writing succeeded -> schedule a response read before attempting a new write
-				nap::Logger::debug("%s: Written %d byte(s)", handle->mAddress.to_string().c_str(), size);
-			});
+				nap::Logger::debug("%s: Written %d byte(s)", handle->mProjector->mIPAddress.c_str(), size);
+
+				// Command completed (timed out) while writing -> write the next one now
+				if (handle->mWritePending)
+				{
+					handle->mWritePending = false;
+					if (!handle->mCmds.empty())
+						handle->write(*handle->mCmds.front().mCommand);
+				}
+			}));
 	}
 
 
@@ -192,7 +642,7 @@ namespace nap
 	{
 		assert(mSocket.is_open());
 		auto handle = shared_from_this();
-		asio::async_read_until(mSocket, mRespBuffer, pjlink::terminator, [handle] (std::error_code ec, std::size_t size)
+		asio::async_read_until(mSocket, mRespBuffer, pjlink::terminator, pjlink::makeHandler(mReadMemory, [handle] (std::error_code ec, std::size_t size)
 			{
 				if (ec)
 				{
@@ -200,87 +650,297 @@ namespace nap
 					{
 						nap::Logger::error("Reading failed (ec '%d'), projector endpoint: %s,\nmsg: %s",
 							ec.value(),
-							handle->mAddress.to_string().c_str(),
+							handle->mProjector->mIPAddress.c_str(),
 							ec.message().c_str());
 					}
 					handle->close();
 					return;
 				}
 
-				// Read succeeded
-				nap::Logger::debug("%s: Read %d byte(s)", handle->mAddress.to_string().c_str(), size);
-
-				// Commit response from buffer input to response
-				assert(!handle->mCmds.empty());
-				auto& reply = *handle->mCmds.front();
-
-				std::istream is(&handle->mRespBuffer);
-				std::getline(std::istream(&handle->mRespBuffer), reply.mResponse, pjlink::terminator);
-
-				// All good
-				nap::Logger::debug("%s: Reply '%s', cmd: '%s'",
-					handle->mAddress.to_string().c_str(),
-					reply.mResponse.substr(0, reply.mResponse.size()-1).c_str(),
-					reply.mCommand.substr(0, reply.mCommand.size()-1).c_str());
-
-				// Forward response and set timer
-				handle->mProjector.response(reply);
-				handle->setTimer();
+				// Discard replies that don't belong to the pending command
+				if (!handle->reply(size))
+				{
+					handle->read();
+					return;
+				}
 
 				// After receiving a response, we're ready to send a subsequent request
 				// PJLink requires the response to be sent before attempting a new write..
-				handle->mCmds.pop();
 				if (!handle->mCmds.empty())
-					handle->write(*(handle->mCmds.front()));
+					handle->next();
 
 				// Keep reading until there's a new response
 				handle->read();
-			});
+			}));
 	}
 
 
-	void PJLinkConnection::close()
+	bool PJLinkConnection::reply(std::size_t size)
 	{
-		// Delete timer -> bail if closed
-		mTimeout.reset(nullptr);
+		// Read succeeded
+		nap::Logger::debug("%s: Read %d byte(s)", mProjector->mIPAddress.c_str(), size);
+
+		// View response in buffer, excluding terminator -> the streambuf input sequence is contiguous
+		assert(size > 0);
+		std::string_view response(static_cast<const char*>(mRespBuffer.data().data()), size - 1);
+
+		// Discard replies that don't belong to the pending command -> late reply of a timed out command
+		if (mCmds.empty() || !isReply(mCmds.front().mCommand->getMessage().view(), response))
+		{
+			nap::Logger::warn("%s: Discarding unexpected reply '%.*s'",
+				mProjector->mIPAddress.c_str(), static_cast<int>(response.size()), response.data());
+			mRespBuffer.consume(size);
+			return false;
+		}
+
+		// Response received in time -> commit response from buffer input to response
+		clearDeadline(mResponseDeadline);
+		auto& reply = *mCmds.front().mCommand;
+		reply.mResponse.assign(response);
+		reply.parseResponse();
+		mRespBuffer.consume(size);
+
+		// All good
+		nap::Logger::debug("%s: Reply '%.*s', cmd: '%.*s'",
+			mProjector->mIPAddress.c_str(),
+			static_cast<int>(reply.mResponse.size()), reply.mResponse.data(),
+			static_cast<int>(reply.size() - 1), reply.data());
+
+		// Forward response and set timer
+		complete(PJLinkCommand::EState::Completed);
+		setTimer(nap::Seconds(sTimeout));
+		return true;
+	}
+
 
-		// Close -> must be open when called deferred
-		if (!mSocket.is_open())
+	void PJLinkConnection::next()
+	{
+		// Wake up session, it writes the next command
+		if (mProjector->mCoroutines)
+		{
+			mSignal.cancel();
 			return;
+		}
 
+		// Only one write at a time -> the next command is written when the current write completes
+		if (mWriting)
+		{
+			mWritePending = true;
+			return;
+		}
+		write(*mCmds.front().mCommand);
+	}
+
+
+	void PJLinkConnection::close(PJLinkCommand::EState reason)
+	{
+		// Cancel timers
+		cancelDeadline(mIdleDeadline);
+		cancelDeadline(mResponseDeadline);
+		mSignal.cancel();
+		mReady = false;
+
+		// Fail commands that didn't receive a response
+		fail(reason);
+
+		// Close once -> handlers of cancelled operations close again
+		if (mClosed)
+			return;
+		mClosed = true;
+
+		// The socket isn't open yet when closed before the coroutine session connects
 		std::error_code ec;
-		mSocket.close(ec);
+		if (mSocket.is_open())
+			mSocket.close(ec);
 		if (ec)
 		{
 			nap::Logger::error("Close request failed (ec '%d'), projector endpoint : %s",
-				ec.value(), mAddress.to_string().c_str());
+				ec.value(), mProjector->mIPAddress.c_str());
 			return;
 		}
 
 		// Cancel outstanding timing operations
-		nap::Logger::debug("%s: Connection closed", mAddress.to_string().c_str());
+		nap::Logger::debug("%s: Connection closed", mProjector->mIPAddress.c_str());
 
 		// Notify listeners
-		mProjector.connectionClosed();
+		mProjector->connectionClosed(*this);
+	}
+
+
+	void PJLinkConnection::connectFailed(PJLinkCommand::EState state)
+	{
+		// Notify projector before closing -> prevents a new connection attempt from being made in between
+		reportResult(false);
+		close(state);
+		mConnected.set_value(false);
+	}
+
+
+	void PJLinkConnection::reportResult(bool success)
+	{
+		// Only the first result of the attempt counts
+		if (mReported)
+			return;
+		mReported = true;
+		mProjector->connectionResult(success);
+	}
+
+
+	void PJLinkConnection::fail(PJLinkCommand::EState state)
+	{
+		while (!mCmds.empty())
+			complete(state);
+	}
+
+
+	void PJLinkConnection::complete(PJLinkCommand::EState state)
+	{
+		// Keep-alive is always in front and never forwarded
+		assert(!mCmds.empty());
+		if (!mHeartbeat)
+		{
+			mDepth--;
+			complete(mCmds.front(), state);
+		}
+
+		mHeartbeat = false;
+		mCmds.pop_front();
+	}
+
+
+	void PJLinkConnection::complete(Request& request, PJLinkCommand::EState state)
+	{
+		// Command is immutable from here on -> all listeners share the same instance.
+		// The control block is allocated from recycled memory, kept alive by the responses allocated from it.
+		request.mCommand->mState = state;
+		PJLinkResponsePtr response(request.mCommand.release(), std::default_delete<PJLinkCommand>(),
+			pjlink::SharedHandlerAllocator<PJLinkCommand, ResponseMemory>(mResponseMemory));
+		mProjector->response(response);
+		if (request.mCompletion)
+			request.mCompletion(response);
+	}
+
+
+	void PJLinkConnection::timeout()
+	{
+		// Connection or authentication deadline passed
+		assert(mSocket.is_open());
+		if (!mReady)
+		{
+			// Notify projector before closing -> the aborted connect handler reports nothing
+			nap::Logger::error("Connection to endpoint: %s timed out", mProjector->mIPAddress.c_str());
+			reportResult(false);
+			close(PJLinkCommand::EState::ConnectionTimedOut);
+			return;
+		}
+
+		// Commands queued or in flight -> not idle, the response deadline of the command guards the exchange
+		if (!mCmds.empty())
+		{
+			setTimer(nap::Seconds(sTimeout));
+			return;
+		}
+
+		// Keep idle connection alive by sending a cheap query -> bail if keep-alive isn't answered
+		if (mProjector->mKeepAlive && mReady && mCmds.empty() && !mHeartbeat)
+		{
+			nap::Logger::debug("%s: Sending keep-alive", mProjector->mIPAddress.c_str());
+			mHeartbeat = true; mKeptAlive = true;
+			mCmds.emplace_back(Request{ std::make_unique<PJLinkGetPowerCommand>(), nullptr });
+			next();
+			setTimer(nap::Seconds(sTimeout));
+			return;
+		}
+
+		nap::Logger::debug("%s: Connection timed out", mProjector->mIPAddress.c_str());
+		close();
 	}
 
 
-	void PJLinkConnection::timeout(const std::error_code& ec)
+	void PJLinkConnection::responseTimeout()
 	{
-		if (!ec)
+		// Keep-alive not answered -> close
+		assert(!mCmds.empty());
+		if (mHeartbeat)
 		{
-			nap::Logger::debug("%s: Connection timed out", mAddress.to_string().c_str());
-			assert(mSocket.is_open());
+			nap::Logger::debug("%s: Keep-alive timed out", mProjector->mIPAddress.c_str());
 			close();
+			return;
 		}
+
+		// Notify listeners and continue with next command
+		auto cmd = mCmds.front().mCommand->getCommand();
+		nap::Logger::warn("%s: Response timed out, cmd: '%.*s'",
+			mProjector->mIPAddress.c_str(), static_cast<int>(cmd.size()), cmd.data());
+
+		complete(PJLinkCommand::EState::ResponseTimedOut);
+
+		// Cancel the read of the session, it continues with the next command.
+		// A write in progress is never cancelled, the session skips the read when the write completes.
+		if (mProjector->mCoroutines)
+		{
+			mAwaiting = false;
+			if (!mWriting)
+			{
+				std::error_code ec;
+				mSocket.cancel(ec);
+			}
+			return;
+		}
+
+		if (!mCmds.empty())
+			next();
 	}
 
 
-	void PJLinkConnection::setTimer()
+	void PJLinkConnection::setTimer(nap::Seconds duration)
 	{
-		mTimeout = std::make_unique<asio::steady_timer>(mSocket.get_executor(), nap::Seconds(sTimeout));
-		mTimeout->async_wait(
-			std::bind(&PJLinkConnection::timeout, shared_from_this(), std::placeholders::_1)
-		);
+		setDeadline(mIdleDeadline, duration, &PJLinkConnection::timeout);
+	}
+
+
+	void PJLinkConnection::setDeadline(Deadline& deadline, nap::Seconds duration, Expired expired)
+	{
+		// Timer expires before the new deadline -> the handler waits for the remainder
+		deadline.mTime = Deadline::Clock::now() + duration;
+		if (deadline.mWait != 0 && deadline.mTimer.expiry() <= deadline.mTime)
+			return;
+		wait(deadline, expired);
+	}
+
+
+	void PJLinkConnection::cancelDeadline(Deadline& deadline)
+	{
+		clearDeadline(deadline);
+		deadline.mWait = 0;
+		deadline.mTimer.cancel();
+	}
+
+
+	void PJLinkConnection::wait(Deadline& deadline, Expired expired)
+	{
+		// Replaces the outstanding wait, if any
+		deadline.mWait = ++deadline.mWaitCount;
+		deadline.mTimer.expires_at(deadline.mTime);
+		deadline.mTimer.async_wait(pjlink::makeHandler(deadline.mMemory, [handle = shared_from_this(), &deadline, expired, id = deadline.mWait](std::error_code ec)
+			{
+				// Cancelled, replaced or closed
+				if (ec || id != deadline.mWait || !handle->mSocket.is_open())
+					return;
+
+				// Deadline cleared or moved while waiting
+				deadline.mWait = 0;
+				if (deadline.mTime == Deadline::Clock::time_point::max())
+					return;
+
+				if (Deadline::Clock::now() < deadline.mTime)
+				{
+					handle->wait(deadline, expired);
+					return;
+				}
+
+				handle->clearDeadline(deadline);
+				(handle.get()->*expired)();
+			}));
 	}
 }
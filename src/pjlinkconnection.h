@@ -7,6 +7,7 @@
 // Local includes
 #include "pjlinkprojectorpool.h"
 #include "pjlinkcommand.h"
+#include "pjlinkhandlermemory.h"
 
 // External includes
 #include <asio/ip/tcp.hpp>
@@ -14,7 +15,7 @@
 #include <asio/steady_timer.hpp>
 #include <utility/dllexport.h>
 #include <nap/timer.h>
-#include <queue>
+#include <deque>
 #include <future>
 
 namespace nap
@@ -22,13 +23,34 @@ namespace nap
 	class PJLinkProjector;
 	namespace pjlink
 	{
-		using Socket = asio::ip::tcp::socket;
+		using Socket = asio::basic_stream_socket<asio::ip::tcp, Strand>;
 		using StreamBuf = asio::streambuf;
+
+		/**
+		 * Returns a completion handler that invokes both handlers, in order.
+		 * @param first first handler to invoke, can be null
+		 * @param second second handler to invoke, can be null
+		 * @return combined completion handler
+		 */
+		PJLinkCompletion chain(PJLinkCompletion first, PJLinkCompletion second);
+
+		/**
+		 * Returns if the module is compiled with coroutine support, required by a projector that enables 'Coroutines'.
+		 * Determined once, when the module is compiled, independent of the language standard of the caller.
+		 * @return if connections can be driven by a coroutine
+		 */
+		bool coroutinesSupported();
 	}
 
 	/**
 	 * PJLink client connection instance, instantiated by the PJLinkProjector.
 	 * Handles all PJLink TCP/IP IO a-synchronous.
+	 * All socket, queue and timer operations are serialized on the strand of this connection.
+	 * The state of every a-synchronous callback operation is allocated from recycled memory owned by the connection.
+	 *
+	 * When the projector enables 'Coroutines' the connection is driven by a single coroutine instead of chained callbacks:
+	 * connect, read banner, then loop: write command, await response with deadline. Queueing, deadlines and
+	 * completion are shared by both implementations. The operations of the coroutine are allocated by asio, not from connection memory.
 	 */
 	class NAPAPI PJLinkConnection : public std::enable_shared_from_this<PJLinkConnection>
 	{
@@ -36,14 +58,8 @@ namespace nap
 		// tcp connection timeout in seconds
 		static constexpr int sTimeout = 20;
 
-		/**
-		 * Creates a pjlink connection.
-		 * @param context pjlink runtime context
-		 * @param address endpoint address
-		 * @param projector interface
-		 * @return pjlink connection handle
-		 */
-		static std::shared_ptr<PJLinkConnection> create(pjlink::Context& context, const asio::ip::address& address, PJLinkProjector& projector);
+		// authentication (banner) timeout in seconds
+		static constexpr int sAuthTimeout = 5;
 
 		// Disable copy
 		PJLinkConnection& operator=(const PJLinkConnection&) = delete;
@@ -61,45 +77,153 @@ namespace nap
 		/**
 		 * Compare if they manage the same projector instance
 		 */
-		bool operator == (const PJLinkProjector& c)		{ return &c == &mProjector; }
+		bool operator == (const PJLinkProjector& c)		{ return &c == mProjector; }
 
 		/**
 		 * Compare if they manage the same projector instance
 		 */
-		bool operator != (const PJLinkProjector& c)		{ return &c != &mProjector; }
+		bool operator != (const PJLinkProjector& c)		{ return &c != mProjector; }
+
+		/**
+		 * @return number of commands queued or in flight, safe to call from any thread
+		 */
+		int getQueueDepth() const						{ return mDepth; }
+
+		/**
+		 * @return number of allocations that weren't served from recycled connection memory, safe to call from any thread
+		 */
+		nap::uint64 getFallbackCount() const;
 
 		// Future connection -> available after establishing connection successful authorization
 		using Future = std::future<std::shared_ptr<PJLinkConnection>>;
 
 	private:
 		friend class PJLinkProjector;
+		friend class PJLinkProjectorPool;
 
+		pjlink::Strand		mStrand;					//< Serializes all handlers of this connection
 		pjlink::Socket		mSocket;					//< Communication socket
-		pjlink::Address		mAddress;					//< Endpoint address description
 		pjlink::EndPoint	mEndpoint;					//< Endpoint description
-		PJLinkProjector&	mProjector;					//< Projector end-point
+		PJLinkProjector*	mProjector = nullptr;		//< Projector end-point
+
+		// Prepares the (recycled) connection for use by the given projector, called by the pool
+		void reset(PJLinkProjector& projector);
 
-		// Called from client thread
-		std::future<bool> connect();
+		// Called from client thread, future resolves after authentication
+		std::shared_future<bool> connect();
 		std::future<void> disconnect();
-		void enqueue(PJLinkCommandPtr cmd);
+		bool enqueue(PJLinkCommandPtr& cmd, PJLinkCompletion& completion);
 
 		// Called from asio execution thread
-		bool authenticate();
+		void authenticate();
+		bool verify(std::size_t size);
 		void write(PJLinkCommand& cmd);
 		void read();
-		void close();
-		void timeout(const std::error_code& ec);
-		void setTimer();
+		bool reply(std::size_t size);
+		void next();
+		void close(PJLinkCommand::EState reason = PJLinkCommand::EState::ConnectionClosed);
+		void fail(PJLinkCommand::EState state);
+		void connectFailed(PJLinkCommand::EState state);
+
+		// Reports the result of the connection attempt to the projector, once
+		void reportResult(bool success);
+
+		// Queued command, including optional completion handler
+		struct Request
+		{
+			PJLinkCommandPtr mCommand;					//< Command to send
+			PJLinkCompletion mCompletion;				//< Called after completion, receives the shared response
+		};
+
+		// Queue nodes are allocated from recycled memory -> the queue doesn't allocate when it grows and shrinks
+		using QueueMemory = pjlink::BasicHandlerMemory<512, 8>;
+		using Requests = std::deque<Request, pjlink::HandlerAllocator<Request, QueueMemory>>;
+
+		// Returns the first request that hasn't been written yet
+		Requests::iterator pending();
+
+		// Merges the request with a pending request, returns false if not merged
+		bool coalesce(Request& request);
+
+		// Queues the request in front of pending telemetry if it is a control command
+		void insert(Request&& request);
+
+		// Drops the oldest pending telemetry when there's more than allowed
+		void limitTelemetry();
+
+		// Makes room for a new request according to the queue policy, returns false if there's no room
+		bool limitDepth();
+
+		// Completes and removes a pending request
+		void drop(Requests::iterator it, PJLinkCommand::EState state);
+
+		// Forwards the command to listeners and pops it from the queue
+		void complete(PJLinkCommand::EState state);
+		void complete(Request& request, PJLinkCommand::EState state);
+		void timeout();
+		void responseTimeout();
+		void setTimer(nap::Seconds duration);
+
+		// Deadline on a single re-usable timer. Moving the deadline doesn't touch the timer,
+		// the timer is only re-armed when it expires before the deadline or when it must expire sooner.
+		struct Deadline
+		{
+			using Clock = pjlink::Timer::clock_type;
+			Deadline(const pjlink::Strand& strand) : mTimer(strand) { }
+
+			pjlink::Timer mTimer;										//< Timer, at most one wait outstanding
+			Clock::time_point mTime = Clock::time_point::max();			//< Current deadline, max if none
+			nap::uint64 mWait = 0;										//< Identifies the outstanding wait, 0 if none
+			nap::uint64 mWaitCount = 0;									//< Number of waits started
+			pjlink::HandlerMemory mMemory;								//< Recycled wait operation memory
+		};
+		using Expired = void (PJLinkConnection::*)();
+
+		// Sets the deadline, calls expired when it passes
+		void setDeadline(Deadline& deadline, nap::Seconds duration, Expired expired);
+
+		// Clears the deadline, without touching the timer
+		void clearDeadline(Deadline& deadline)			{ deadline.mTime = Deadline::Clock::time_point::max(); }
+
+		// Clears the deadline and cancels the timer
+		void cancelDeadline(Deadline& deadline);
+
+		// Starts waiting for the deadline
+		void wait(Deadline& deadline, Expired expired);
+
+		// Shared responses can outlive the connection -> the memory is owned by the connection and all responses allocated from it
+		using ResponseMemory = pjlink::BasicHandlerMemory<64, 32>;
 
 		// A-sync objects -> accessed from socket execution context
 		pjlink::StreamBuf mAuthBuffer;					//< Authentication buffer
 		pjlink::StreamBuf  mRespBuffer;					//< Response buffer
-		std::queue<PJLinkCommandPtr> mCmds;				//< Commands to send
-		std::unique_ptr<asio::steady_timer> mTimeout;	//< Timeout connection timer
+		QueueMemory mQueueMemory;						//< Recycled command queue memory
+		Requests mCmds;									//< Commands to send, the one in front is in flight when ready
+		Deadline mIdleDeadline;							//< Connect, authentication and idle deadline
+		Deadline mResponseDeadline;						//< Response deadline of the command in flight
+		pjlink::HandlerMemory mReadMemory;				//< Recycled connect and read operation memory
+		pjlink::HandlerMemory mWriteMemory;				//< Recycled write operation memory
+		pjlink::BasicHandlerMemory<256, 8> mPostMemory;	//< Recycled enqueue and disconnect operation memory, multiple posts can be outstanding
+		std::shared_ptr<ResponseMemory> mResponseMemory;	//< Recycled shared response control block memory
+		pjlink::Message mWriteBuffer;					//< Copy of the command being written
+
+		// Coroutine that connects, authenticates and writes commands until closed, defined when coroutines are supported
+		struct Session;
+		pjlink::Timer mSignal { mStrand };				//< Wakes up the session when a command is queued
+		bool mAwaiting = false;							//< If the session is waiting for a response
 		std::atomic<bool> mReady = { false };			//< If io connection is active
-
-		// Constructor -> private, use create()
-		PJLinkConnection(pjlink::Context& context, const asio::ip::address& address, PJLinkProjector& projector);
+		std::atomic<int> mDepth = { 0 };				//< Number of commands queued or in flight, including posted commands
+		bool mHeartbeat = false;						//< If a keep-alive query is outstanding
+		bool mKeptAlive = false;						//< If the connection has been kept alive since the last command
+		bool mWriting = false;							//< If a write is in progress
+		bool mWritePending = false;						//< If the next command must be written after the current write completes
+		bool mReported = false;							//< If the result of the connection attempt has been reported
+		bool mClosed = false;							//< If the connection has been closed, also when the socket was never opened
+		pjlink::BasicHandlerMemory<128, 4> mPromiseMemory;	//< Recycled connection and disconnect result state
+		std::promise<bool> mConnected;					//< Resolved after authentication
+		std::shared_future<bool> mConnectFuture;		//< Connection (authentication) result
+
+		// Constructor -> private, connections are created and recycled by the pool
+		PJLinkConnection(pjlink::Context& context);
 	};
 }
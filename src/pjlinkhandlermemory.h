@@ -0,0 +1,184 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// External includes
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+namespace nap
+{
+	namespace pjlink
+	{
+		/**
+		 * Fixed number of fixed size memory blocks, recycled by every a-synchronous operation that uses them.
+		 * Intended for a bounded number of outstanding operations, for example the read loop of a connection.
+		 * Falls back to the global allocator when all blocks are in use or the request is too large.
+		 */
+		template<std::size_t Size, std::size_t Count = 1>
+		class BasicHandlerMemory
+		{
+		public:
+			BasicHandlerMemory() = default;
+
+			// Disable copy and move
+			BasicHandlerMemory(const BasicHandlerMemory&) = delete;
+			BasicHandlerMemory& operator=(const BasicHandlerMemory&) = delete;
+
+			/**
+			 * @param size number of bytes to allocate
+			 * @return recycled block if available and large enough, memory from the global allocator otherwise
+			 */
+			void* allocate(std::size_t size)
+			{
+				if (size <= Size)
+				{
+					for (auto& block : mBlocks)
+					{
+						if (!block.mInUse.load(std::memory_order_relaxed) && !block.mInUse.exchange(true, std::memory_order_acquire))
+							return &block.mStorage;
+					}
+				}
+				mFallbacks.fetch_add(1, std::memory_order_relaxed);
+				return ::operator new(size);
+			}
+
+			/**
+			 * Releases memory allocated by allocate(), can be called from any thread.
+			 * @param pointer memory to release
+			 */
+			void deallocate(void* pointer)
+			{
+				for (auto& block : mBlocks)
+				{
+					if (pointer == &block.mStorage)
+					{
+						block.mInUse.store(false, std::memory_order_release);
+						return;
+					}
+				}
+				::operator delete(pointer);
+			}
+
+			/**
+			 * @return number of allocations that were not served from a recycled block, safe to call from any thread
+			 */
+			std::size_t getFallbackCount() const						{ return mFallbacks.load(std::memory_order_relaxed); }
+
+		private:
+			struct Block
+			{
+				alignas(std::max_align_t) unsigned char mStorage[Size];		//< Recycled memory
+				std::atomic<bool> mInUse = { false };						//< If the block is handed out
+			};
+			std::array<Block, Count> mBlocks;								//< Recycled blocks
+			std::atomic<std::size_t> mFallbacks = { 0 };					//< Number of allocations served by the global allocator
+		};
+
+		// Single block, large enough for composed read and write operations
+		using HandlerMemory = BasicHandlerMemory<1024>;
+
+
+		/**
+		 * Allocator that allocates from recycled handler memory, associated with a-synchronous handlers.
+		 * Can also be handed to standard library types that accept an allocator, such as std::shared_ptr.
+		 */
+		template<typename T, typename Memory = HandlerMemory>
+		class HandlerAllocator
+		{
+		public:
+			using value_type = T;
+
+			explicit HandlerAllocator(Memory& memory) noexcept : mMemory(&memory)							{ }
+
+			template<typename U>
+			HandlerAllocator(const HandlerAllocator<U, Memory>& other) noexcept : mMemory(other.mMemory)	{ }
+
+			T* allocate(std::size_t count)						{ return static_cast<T*>(mMemory->allocate(sizeof(T) * count)); }
+			void deallocate(T* pointer, std::size_t)			{ mMemory->deallocate(pointer); }
+
+			bool operator==(const HandlerAllocator& other) const noexcept		{ return mMemory == other.mMemory; }
+			bool operator!=(const HandlerAllocator& other) const noexcept		{ return mMemory != other.mMemory; }
+
+		private:
+			template<typename, typename> friend class HandlerAllocator;
+			Memory* mMemory;
+		};
+
+
+		/**
+		 * Allocator that shares ownership of the recycled handler memory.
+		 * Used for allocations that can outlive the owner of the memory, such as the control block of a shared response.
+		 */
+		template<typename T, typename Memory>
+		class SharedHandlerAllocator
+		{
+		public:
+			using value_type = T;
+
+			explicit SharedHandlerAllocator(std::shared_ptr<Memory> memory) noexcept : mMemory(std::move(memory))		{ }
+
+			template<typename U>
+			SharedHandlerAllocator(const SharedHandlerAllocator<U, Memory>& other) noexcept : mMemory(other.mMemory)	{ }
+
+			T* allocate(std::size_t count)						{ return static_cast<T*>(mMemory->allocate(sizeof(T) * count)); }
+			void deallocate(T* pointer, std::size_t)			{ mMemory->deallocate(pointer); }
+
+			bool operator==(const SharedHandlerAllocator& other) const noexcept		{ return mMemory == other.mMemory; }
+			bool operator!=(const SharedHandlerAllocator& other) const noexcept		{ return mMemory != other.mMemory; }
+
+		private:
+			template<typename, typename> friend class SharedHandlerAllocator;
+			std::shared_ptr<Memory> mMemory;
+		};
+
+
+		/**
+		 * Completion handler wrapper, associates the handler memory with the handler.
+		 * All intermediate and final operation state of the a-synchronous operation is allocated from that memory.
+		 */
+		template<typename Handler, typename Memory = HandlerMemory>
+		class AllocHandler
+		{
+		public:
+			using allocator_type = HandlerAllocator<Handler, Memory>;
+
+			AllocHandler(Memory& memory, Handler handler) :
+				mMemory(&memory), mHandler(std::move(handler))					{ }
+
+			allocator_type get_allocator() const noexcept						{ return allocator_type(*mMemory); }
+
+			template<typename ... Args>
+			void operator()(Args&& ... args)									{ mHandler(std::forward<Args>(args)...); }
+
+		private:
+			Memory* mMemory;
+			Handler mHandler;
+		};
+
+
+		/**
+		 * Wraps the handler, all operation state is allocated from the given memory.
+		 *
+		 * ~~~~~{.cpp}
+		 * mSocket.async_read_some(buffer, pjlink::makeHandler(mReadMemory, [](std::error_code ec, std::size_t size) { ... }));
+		 * ~~~~~
+		 *
+		 * @param memory recycled memory to allocate from, must outlive the operation
+		 * @param handler completion handler
+		 * @return handler with associated allocator
+		 */
+		template<typename Memory, typename Handler>
+		AllocHandler<std::decay_t<Handler>, Memory> makeHandler(Memory& memory, Handler&& handler)
+		{
+			return AllocHandler<std::decay_t<Handler>, Memory>(memory, std::forward<Handler>(handler));
+		}
+	}
+}
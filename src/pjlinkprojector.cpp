@@ -8,89 +8,420 @@
 // External includes
 #include <nap/logger.h>
 #include <asio/ip/address.hpp>
+#include <asio/post.hpp>
+#include <asio/use_future.hpp>
+#include <cmath>
 
 RTTI_BEGIN_CLASS(nap::PJLinkProjector)
 	RTTI_PROPERTY("IP Address", &nap::PJLinkProjector::mIPAddress, nap::rtti::EPropertyMetaData::Required, "IP address of the projector on the network")
 	RTTI_PROPERTY("Pool", &nap::PJLinkProjector::mPool, nap::rtti::EPropertyMetaData::Required, "Interface that manages the connection")
 	RTTI_PROPERTY("ConnectOnStartup", &nap::PJLinkProjector::mConnect, nap::rtti::EPropertyMetaData::Default, "Connect to projector on startup, init will fail if connection can't be established")
+	RTTI_PROPERTY("KeepAlive", &nap::PJLinkProjector::mKeepAlive, nap::rtti::EPropertyMetaData::Default, "Keep the connection open by sending a query when idle")
+	RTTI_PROPERTY("ConnectTimeout", &nap::PJLinkProjector::mConnectTimeout, nap::rtti::EPropertyMetaData::Default, "Max number of seconds to establish a connection, queued commands fail afterwards")
+	RTTI_PROPERTY("Coalesce", &nap::PJLinkProjector::mCoalesce, nap::rtti::EPropertyMetaData::Default, "Merge pending commands: a set command replaces a pending set command with the same body, duplicate queries are sent once")
+	RTTI_PROPERTY("ResponseTimeout", &nap::PJLinkProjector::mResponseTimeout, nap::rtti::EPropertyMetaData::Default, "Default max number of seconds to wait for a response, the command fails afterwards")
+	RTTI_PROPERTY("MaxQueueDepth", &nap::PJLinkProjector::mMaxQueueDepth, nap::rtti::EPropertyMetaData::Default, "Max number of commands queued or in flight, 0 = unlimited")
+	RTTI_PROPERTY("QueuePolicy", &nap::PJLinkProjector::mQueuePolicy, nap::rtti::EPropertyMetaData::Default, "What to do with a command when the queue is full")
+	RTTI_PROPERTY("CircuitBreaker", &nap::PJLinkProjector::mCircuitBreaker, nap::rtti::EPropertyMetaData::Default, "Fail commands immediately after a failed connection attempt, with exponential backoff between attempts")
+	RTTI_PROPERTY("MinBackoff", &nap::PJLinkProjector::mMinBackoff, nap::rtti::EPropertyMetaData::Default, "Seconds to wait after the first failed connection attempt")
+	RTTI_PROPERTY("MaxBackoff", &nap::PJLinkProjector::mMaxBackoff, nap::rtti::EPropertyMetaData::Default, "Max number of seconds to wait between connection attempts")
+	RTTI_PROPERTY("Coroutines", &nap::PJLinkProjector::mCoroutines, nap::rtti::EPropertyMetaData::Default, "Drive the connection with a single C++20 coroutine instead of chained callbacks, requires coroutine support")
+	RTTI_PROPERTY("MaxTelemetry", &nap::PJLinkProjector::mMaxTelemetry, nap::rtti::EPropertyMetaData::Default, "Max number of pending telemetry commands (queries), the oldest is dropped when exceeded, 0 = unlimited")
+	RTTI_PROPERTY("PowerCacheTTL", &nap::PJLinkProjector::mPowerCacheTTL, nap::rtti::EPropertyMetaData::Default, "Max age in seconds of a cached power query response, 0 = disabled")
+	RTTI_PROPERTY("AVMuteCacheTTL", &nap::PJLinkProjector::mAVMuteCacheTTL, nap::rtti::EPropertyMetaData::Default, "Max age in seconds of a cached mute query response, 0 = disabled")
+	RTTI_PROPERTY("ErrorCacheTTL", &nap::PJLinkProjector::mErrorCacheTTL, nap::rtti::EPropertyMetaData::Default, "Max age in seconds of a cached error status query response, 0 = disabled")
+	RTTI_PROPERTY("LampCacheTTL", &nap::PJLinkProjector::mLampCacheTTL, nap::rtti::EPropertyMetaData::Default, "Max age in seconds of a cached lamp query response, 0 = disabled")
 RTTI_END_CLASS
 
+RTTI_BEGIN_ENUM(nap::PJLinkProjector::EQueuePolicy)
+	RTTI_ENUM_VALUE(nap::PJLinkProjector::EQueuePolicy::Reject,			"Reject"),
+	RTTI_ENUM_VALUE(nap::PJLinkProjector::EQueuePolicy::DropOldest,		"Drop Oldest"),
+	RTTI_ENUM_VALUE(nap::PJLinkProjector::EQueuePolicy::DropTelemetry,	"Drop Telemetry")
+RTTI_END_ENUM
+
+RTTI_BEGIN_ENUM(nap::PJLinkProjector::ECircuitState)
+	RTTI_ENUM_VALUE(nap::PJLinkProjector::ECircuitState::Closed,		"Closed"),
+	RTTI_ENUM_VALUE(nap::PJLinkProjector::ECircuitState::Open,			"Open"),
+	RTTI_ENUM_VALUE(nap::PJLinkProjector::ECircuitState::HalfOpen,		"Half Open")
+RTTI_END_ENUM
+
 namespace nap
 {
-	bool PJLinkProjector::start(utility::ErrorState& errorState)
+	bool PJLinkProjector::init(utility::ErrorState& errorState)
 	{
-		// If connection on startup is requested -> force
+		if (!errorState.check(mConnectTimeout > 0, "%s: invalid connect timeout: %d", mID.c_str(), mConnectTimeout))
+			return false;
+
+		if (!errorState.check(mResponseTimeout > 0, "%s: invalid response timeout: %d", mID.c_str(), mResponseTimeout))
+			return false;
+
+		if (!errorState.check(!mCoroutines || pjlink::coroutinesSupported(), "%s: coroutines not supported, module compiled without C++20 coroutine support", mID.c_str()))
+			return false;
+
+		// Parse endpoint once -> reused by every connection, an invalid address fails every connection attempt
+		std::error_code ec;
+		auto address = asio::ip::make_address(mIPAddress, ec);
+		mValidAddress = !ec;
+		if (mValidAddress)
+			mEndpoint = pjlink::EndPoint(address, pjlink::port);
+
+		if (!errorState.check(mMinBackoff > 0.0f && mMaxBackoff >= mMinBackoff, "%s: invalid backoff range: %.2f - %.2f",
+			mID.c_str(), mMinBackoff, mMaxBackoff))
+			return false;
+
+		// All connections of this projector run on the same pool thread
+		mWorker = mPool->assignWorker();
+		mStrand = std::make_unique<pjlink::Strand>(asio::make_strand(mPool->getContext(mWorker)));
+
+		// Connect together with all other projectors of the pool on startup
 		if (mConnect)
-		{
-			// Create client connection
-			auto client = getConnection(true, errorState);
-			if (client == nullptr)
-				return false;
+			mPool->addStartup(*this);
 
-			// Connect
-			if (!errorState.check(client->connect().wait_for(nap::Seconds(10)) == std::future_status::ready,
-				"Connection to endpoint '%s' timed out", mIPAddress.c_str()))
+		// Setup query cache
+		mCache[0].mBody = pjlink::cmd::get::power;	mCache[0].mTTL = mPowerCacheTTL;
+		mCache[1].mBody = pjlink::cmd::get::avmute;	mCache[1].mTTL = mAVMuteCacheTTL;
+		mCache[2].mBody = pjlink::cmd::get::error;	mCache[2].mTTL = mErrorCacheTTL;
+		mCache[3].mBody = pjlink::cmd::get::hours;	mCache[3].mTTL = mLampCacheTTL;
+		for (const auto& entry : mCache)
+		{
+			if (!errorState.check(entry.mTTL >= 0.0f, "%s: invalid '%s' cache TTL: %.2f", mID.c_str(), std::string(entry.mBody).c_str(), entry.mTTL))
 				return false;
 		}
 		return true;
 	}
 
 
+	bool PJLinkProjector::start(utility::ErrorState& errorState)
+	{
+		// Restart -> previous connection must be closed
+		waitDisconnect();
+
+		// If connection on startup is requested -> connect together with all other projectors of the pool
+		if (mConnect && !mPool->connectOnStartup(*this, errorState))
+			return false;
+
+		// Register for status polling
+		mPool->registerProjector(*this);
+		return true;
+	}
+
+
 	void PJLinkProjector::stop()
 	{
+		// Stop status polling
+		mPool->unregisterProjector(*this);
+
+		// Start disconnect, don't wait -> all projectors that stop together disconnect in parallel.
+		// The disconnect is awaited on destruction or restart, against the deadline shared by all projectors of the pool.
 		utility::ErrorState error;
 		auto client = getConnection(false, error);
 		if (client != nullptr)
 		{
-			auto cf = client->disconnect();
-			if (cf.wait_for(nap::Seconds(10)) != std::future_status::ready)
-				nap:Logger::warn("Unable to gracefully shut down '%s' connection", mID.c_str());
+			mDisconnected = client->disconnect();
+			mDisconnectDeadline = mPool->beginShutdown();
+		}
+
+		// Don't answer queries with responses from a previous session
+		{
+			std::lock_guard<std::mutex> lock(mCacheMutex);
+			for (auto& entry : mCache)
+				entry.mResponse = nullptr;
+		}
+
+		// Deliver cached answers before listeners go away
+		drain();
+	}
+
+
+	void PJLinkProjector::onDestroy()
+	{
+		mPool->removeStartup(*this);
+		waitDisconnect();
+		drain();
+	}
+
 
+	void PJLinkProjector::drain()
+	{
+		// Handlers of a strand run in order -> all previously posted answers are delivered when this one runs
+		if (mStrand != nullptr)
+			asio::post(*mStrand, asio::use_future([] {})).wait();
+	}
+
+
+	void PJLinkProjector::waitDisconnect()
+	{
+		if (!mDisconnected.valid())
+			return;
+
+		// Outstanding work is cancelled by the pool when the connection isn't closed in time
+		if (mDisconnected.wait_until(mDisconnectDeadline) != std::future_status::ready)
+		{
+			nap::Logger::warn("Unable to gracefully shut down '%s' connection", mID.c_str());
+			mPool->mShutdownStalled = true;
+		}
+		else
+		{
 			// Connection should be reset after a disconnect
 			assert(mConnection == nullptr);
 		}
+		mDisconnected = std::future<void>();
+	}
+
+
+	std::shared_future<bool> PJLinkProjector::startConnect(utility::ErrorState& error)
+	{
+		auto client = getConnection(true, error);
+		return client != nullptr ? client->mConnectFuture : std::shared_future<bool>();
+	}
+
+
+	bool PJLinkProjector::send(PJLinkCommandPtr cmd)
+	{
+		return send(std::move(cmd), nullptr);
+	}
+
+
+	bool PJLinkProjector::send(PJLinkCommandPtr cmd, PJLinkCompletion completion)
+	{
+		// Not cached -> send
+		auto* entry = findCacheEntry(*cmd);
+		if (entry == nullptr)
+			return dispatch(std::move(cmd), std::move(completion));
+
+		// Set command -> invalidates cached response and query in flight
+		std::unique_lock<std::mutex> lock(mCacheMutex);
+		if (!cmd->isQuery())
+		{
+			entry->mResponse = nullptr;
+			entry->mFlight = nullptr;
+			lock.unlock();
+			return dispatch(std::move(cmd), std::move(completion));
+		}
+
+		// Fresh response of same type -> answer from cache
+		auto type = cmd->get_type();
+		auto now = std::chrono::steady_clock::now();
+		if (entry->mResponse != nullptr && entry->mResponse->get_type() == type &&
+			now - entry->mTime < std::chrono::duration<float>(entry->mTTL))
+		{
+			auto cached = entry->mResponse;
+			lock.unlock();
+			mCacheHits++;
+
+			// Answer from the network processing thread, as if received: notify listeners and call completion.
+			// The projector waits for the answer on stop and destruction.
+			asio::post(*mStrand, [this, cached = std::move(cached), completion = std::move(completion)]()
+				{
+					response(cached);
+					if (completion)
+						completion(cached);
+				});
+			return true;
+		}
+
+		// Same query in flight -> wait for its response
+		if (entry->mFlight != nullptr && entry->mFlight->mType == type)
+		{
+			entry->mFlight->mWaiting = pjlink::chain(std::move(entry->mFlight->mWaiting), std::move(completion));
+			mCacheHits++;
+			return true;
+		}
+
+		// Send query, cache response and answer all waiting requests on completion
+		auto flight = std::make_shared<Flight>();
+		flight->mType = type;
+		entry->mFlight = flight;
+		lock.unlock();
+		mCacheMisses++;
+
+		return dispatch(std::move(cmd), [this, entry, flight, completion = std::move(completion)](const PJLinkResponsePtr& result)
+			{
+				PJLinkCompletion waiting = nullptr;
+				{
+					std::lock_guard<std::mutex> lock(mCacheMutex);
+					waiting = std::move(flight->mWaiting);
+					flight->mWaiting = nullptr;
+
+					// Only cache when not invalidated by a set command in the meantime
+					if (entry->mFlight == flight)
+					{
+						entry->mFlight = nullptr;
+						if (result->getState() == PJLinkCommand::EState::Completed)
+						{
+							entry->mResponse = result;
+							entry->mTime = std::chrono::steady_clock::now();
+						}
+					}
+				}
+
+				if (completion)
+					completion(result);
+				if (waiting)
+					waiting(result);
+			});
 	}
 
 
-	void PJLinkProjector::send(PJLinkCommandPtr cmd)
+	bool PJLinkProjector::dispatch(PJLinkCommandPtr cmd, PJLinkCompletion completion)
 	{
 		utility::ErrorState error;
 		auto client = getConnection(true, error);
 		if (client == nullptr)
 		{
-			nap::Logger::error(error.toString());
+			// No error -> circuit is open, fail fast without logging
+			auto state = PJLinkCommand::EState::CircuitOpen;
+			if (error.hasErrors())
+			{
+				nap::Logger::error(error.toString());
+				state = PJLinkCommand::EState::ConnectionFailed;
+			}
+			refuse(std::move(cmd), std::move(completion), state);
+			return false;
+		}
+
+		// Queue is full
+		if (!client->enqueue(cmd, completion))
+		{
+			mRejected++;
+			refuse(std::move(cmd), std::move(completion), PJLinkCommand::EState::Rejected);
+			return false;
+		}
+		return true;
+	}
+
+
+	void PJLinkProjector::refuse(PJLinkCommandPtr cmd, PJLinkCompletion completion, PJLinkCommand::EState state)
+	{
+		// Answer from the network processing thread, similar to a command that fails on the connection
+		cmd->mState = state;
+		asio::post(*mStrand, [this, failed = PJLinkResponsePtr(std::move(cmd)), completion = std::move(completion)]()
+			{
+				response(failed);
+				if (completion)
+					completion(failed);
+			});
+	}
+
+
+	int PJLinkProjector::getQueueDepth()
+	{
+		std::lock_guard<std::mutex> lock(mConnectionMutex);
+		return mConnection != nullptr ? mConnection->getQueueDepth() : 0;
+	}
+
+
+	std::future<PJLinkResponsePtr> PJLinkProjector::request(PJLinkCommandPtr cmd)
+	{
+		// Completion handler must be copyable -> share promise
+		auto promise = std::make_shared<std::promise<PJLinkResponsePtr>>();
+		auto future = promise->get_future();
+		send(std::move(cmd), [promise](const PJLinkResponsePtr& result)
+			{
+				promise->set_value(result);
+			});
+		return future;
+	}
+
+
+	PJLinkProjector::CacheEntry* PJLinkProjector::findCacheEntry(const PJLinkCommand& cmd)
+	{
+		auto body = cmd.getBody();
+		for (auto& entry : mCache)
+		{
+			if (entry.mTTL > 0.0f && entry.mBody == body)
+				return &entry;
+		}
+		return nullptr;
+	}
+
+
+	void PJLinkProjector::connectionClosed(const PJLinkConnection& connection)
+	{
+		// Clear current connection, unless it has already been replaced
+		std::lock_guard<std::mutex> lock(mConnectionMutex);
+		if (mConnection.get() == &connection)
+			mConnection = nullptr;
+	}
+
+
+	void PJLinkProjector::connectionResult(bool success)
+	{
+		std::lock_guard<std::mutex> lock(mConnectionMutex);
+		if (success)
+		{
+			if (mCircuit != ECircuitState::Closed)
+				nap::Logger::info("%s: Projector reachable, circuit closed", mID.c_str());
+			mCircuit = ECircuitState::Closed;
+			mFailures = 0;
 			return;
 		}
-		client->enqueue(std::move(cmd));
+
+		// Open circuit, double the backoff with every consecutive failure
+		if (!mCircuitBreaker)
+			return;
+
+		mFailures++;
+		double backoff = std::min<double>(mMinBackoff * std::pow(2.0, std::min(mFailures - 1, 30)), mMaxBackoff);
+		mRetryTime = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(backoff));
+		mCircuit = ECircuitState::Open;
+		nap::Logger::warn("%s: Projector unreachable, failing commands for %.1f second(s)", mID.c_str(), backoff);
 	}
 
 
-	void PJLinkProjector::connectionClosed()
+	PJLinkProjector::ECircuitState PJLinkProjector::getCircuitState()
 	{
-		// Clear current connection
 		std::lock_guard<std::mutex> lock(mConnectionMutex);
-		mConnection = nullptr;
+		return mCircuit;
 	}
 
 
-	void PJLinkProjector::response(const PJLinkCommand& message)
+	void PJLinkProjector::response(const PJLinkResponsePtr& message)
 	{
-		// Notify listeners
-		responseReceived(message);
+		// Update state and notify listeners
+		if (message->getState() == PJLinkCommand::EState::Completed)
+			updateState(*message);
+		responseReceived(*message);
+		sharedResponseReceived(message);
 	}
 
 
-	std::shared_ptr<PJLinkConnection> PJLinkProjector::create(utility::ErrorState& error)
+	void PJLinkProjector::updateState(const PJLinkCommand& command)
 	{
-		// Make ip address
-		std::error_code ec;
-		auto ip_address = asio::ip::make_address(mIPAddress, ec);
-		if (!error.check(!ec, "Invalid ip address: '%s'", mIPAddress.c_str()))
-			return nullptr;
+		// Writers are serialized, readers never block
+		std::lock_guard<std::mutex> lock(mStateMutex);
+		auto state = mState.load();
+		auto type = command.get_type();
+		if (type.is_derived_from(RTTI_OF(PJLinkGetPowerCommand)))
+		{
+			state.mPower = static_cast<const PJLinkGetPowerCommand&>(command).getStatus();
+		}
+		else if (type.is_derived_from(RTTI_OF(PJLinkGetAVMuteCommand)))
+		{
+			state.mAVMute = static_cast<const PJLinkGetAVMuteCommand&>(command).getStatus();
+		}
+		else if (type.is_derived_from(RTTI_OF(PJLinkGetLampStatusCommand)))
+		{
+			state.mLampHours = static_cast<const PJLinkGetLampStatusCommand&>(command).getHours();
+		}
+		else if (type.is_derived_from(RTTI_OF(PJLinkGetErrorStatusCommand)))
+		{
+			const auto& error_cmd = static_cast<const PJLinkGetErrorStatusCommand&>(command);
+			state.mErrors = error_cmd.getErrors();
+			state.mWarnings = error_cmd.getWarnings();
+		}
+		else
+		{
+			return;
+		}
+		state.mRevision++;
+		mState.store(state);
+	}
 
-		// Create client and connect
-		auto client = PJLinkConnection::create(mPool->mContext, ip_address, *this);
-		return client;
+
+	std::shared_ptr<PJLinkConnection> PJLinkProjector::create()
+	{
+		return mPool->acquireConnection(*this);
 	}
 
 
@@ -99,11 +430,20 @@ namespace nap
 		std::lock_guard<std::mutex> lock(mConnectionMutex);
 		if (mConnection == nullptr && setup)
 		{
-			mConnection = create(error);
-			if (mConnection != nullptr)
+			if (!error.check(mValidAddress, "Invalid ip address: '%s'", mIPAddress.c_str()))
+				return nullptr;
+
+			// Circuit open -> don't connect until the backoff expires, fails without error
+			if (mCircuit == ECircuitState::Open)
 			{
-				mConnection->connect();
+				if (std::chrono::steady_clock::now() < mRetryTime)
+					return nullptr;
+				mCircuit = ECircuitState::HalfOpen;
 			}
+
+			mConnection = create();
+			mConnectionCount++;
+			mConnection->connect();
 		}
 		return mConnection;
 	}
@@ -8,11 +8,13 @@
 #include "pjlinkprojectorpool.h"
 #include "pjlinkconnection.h"
 #include "pjlinkcommand.h"
+#include "pjlinkprojectorstate.h"
 
 // External includes
 #include <nap/device.h>
 #include <nap/resourceptr.h>
 #include <mutex>
+#include <chrono>
 #include <nap/signalslot.h>
 
 namespace nap
@@ -26,6 +28,8 @@ namespace nap
 	 * 
 	 * A connection remains available for 20 seconds after receiving the last response from the projector.
 	 * Subsequent messages will establish a new connection, as outlined in the pjlink protocol document.
+	 * Enable 'KeepAlive' to keep the connection open: a cheap (power) query is sent instead of closing an idle connection.
+	 * Keep-alive responses are not forwarded to listeners.
 	 * You as a user don't have to worry about the state of the connection, that is done here for you.
 	 * 
 	 * All communication is a-synchronous: all calls to send() will return immediately -> the command is queued for write.
@@ -35,11 +39,46 @@ namespace nap
 	 * You must assign a nap::PJLinkProjectorPool to every projector.
 	 * 
 	 * The pool runs all queued I/O network requests a-synchronous on it's assigned worker thread.
+	 *
+	 * Queries can be answered from cache by setting a 'CacheTTL' for the query type.
+	 * A query is answered by the last response, if it is younger than the TTL, or merged with the same query in flight.
+	 * In both cases the connection isn't used. A set command with the same body invalidates the cached response.
+	 * A query answered from cache is forwarded to listeners and its completion handler, from the network processing thread.
+	 * Queries merged with the same query in flight share its response: listeners receive that response once.
+	 *
+	 * Control (set) commands are written before pending telemetry (queries), once the response to the command in flight is received.
+	 * Set 'MaxTelemetry' to drop the oldest pending telemetry when the queue is under pressure.
+	 * Set 'MaxQueueDepth' to bound the queue, the 'QueuePolicy' decides what happens when it is full.
+	 * send() only returns false for commands refused by the 'Reject' policy. The drop policies decide on the network thread:
+	 * a command that can't be queued there completes with state 'Rejected', after send() returned true.
+	 *
+	 * Enable 'CircuitBreaker' to stop connecting to an unreachable projector on every command.
+	 * After a failed connection attempt commands fail immediately, until the (exponential) backoff expires.
 	 */
 	class NAPAPI PJLinkProjector : public Device
 	{
 		RTTI_ENABLE(Device)
 	public:
+		/**
+		 * What to do with a command when the queue is full, see 'MaxQueueDepth'
+		 */
+		enum class EQueuePolicy : nap::uint8
+		{
+			Reject			= 0,		//< Refuse the new command, send() returns false
+			DropOldest		= 1,		//< Drop the oldest pending command, reject the new command if there is none (reported through the completion only)
+			DropTelemetry	= 2			//< Drop the oldest pending telemetry command, reject the new command if there is none (reported through the completion only)
+		};
+
+		/**
+		 * Circuit breaker state, see 'CircuitBreaker'
+		 */
+		enum class ECircuitState : nap::uint8
+		{
+			Closed			= 0,		//< Projector reachable, commands are sent
+			Open			= 1,		//< Projector unreachable, commands fail immediately until the backoff expires
+			HalfOpen		= 2			//< Backoff expired, a single connection attempt decides if the circuit closes or opens again
+		};
+
 		/**
 		 * Turns the projector on
 		 */
@@ -66,8 +105,9 @@ namespace nap
 		 * Sends a PJLink command to the projector a-sync.
 		 * This function returns immediately, the command is queued.
 		 * @param cmd command to send
+		 * @return if the command is queued, false when refused or when a connection can't be created
 		 */
-		void send(PJLinkCommandPtr cmd);
+		bool send(PJLinkCommandPtr cmd);
 
 		/**
 		 * Sends a PJLink command of type CMD to the projector a-sync
@@ -78,57 +118,255 @@ namespace nap
 		 * ~~~~~
 		 * 
 		 * @param args optional PJLink command arguments
+		 * @return if the command is queued, false when refused or when a connection can't be created
+		 */
+		template<typename CMD, typename ... Args>
+		bool send(Args&& ... args)										{ return send(std::make_unique<CMD>(std::forward<Args>(args)...)); }
+
+		/**
+		 * Sends a PJLink command to the projector a-sync.
+		 * This function returns immediately, the command is queued.
+		 * The completion handler is called from the **network processing thread** when the command
+		 * completes or fails, and receives the (immutable) command including its response.
+		 * When the command is refused the handler is called from the network processing thread as well, after this function returned false.
+		 * 
+		 * ~~~~~{.cpp}
+		 * projector->send(std::make_unique<PJLinkGetPowerCommand>(), [](const PJLinkResponsePtr& cmd)
+		 *	{
+		 *		if (cmd->getState() == PJLinkCommand::EState::Completed) { ... }
+		 *	});
+		 * ~~~~~
+		 * 
+		 * @param cmd command to send
+		 * @param completion called after completion, receives the command including response
+		 * @return if the command is queued, false when refused or when a connection can't be created
+		 */
+		bool send(PJLinkCommandPtr cmd, PJLinkCompletion completion);
+
+		/**
+		 * Sends a PJLink command to the projector a-sync.
+		 * This function returns immediately, the command is queued.
+		 * The future becomes available when the command completes or fails,
+		 * use PJLinkCommand::getState() to check the result.
+		 * @param cmd command to send
+		 * @return the command, including its response, when completed or failed
+		 */
+		std::future<PJLinkResponsePtr> request(PJLinkCommandPtr cmd);
+
+		/**
+		 * Sends a PJLink command of type CMD to the projector a-sync.
+		 * This function returns immediately, the command is queued.
+		 *
+		 * ~~~~~{.cpp}
+		 * auto power = projector->request<PJLinkGetPowerCommand>();
+		 * ~~~~~
+		 *
+		 * @param args optional PJLink command arguments
+		 * @return the command, including its response, when completed or failed
 		 */
 		template<typename CMD, typename ... Args>
-		void send(Args&& ... args)										{ send(std::make_unique<CMD>(std::forward<Args>(args)...)); }
+		std::future<PJLinkResponsePtr> request(Args&& ... args)			{ return request(std::make_unique<CMD>(std::forward<Args>(args)...)); }
 
 		/**
 		 * Creates and sends a PJLink command to the projector a-sync.
 		 * This function returns immediately, the command is queued.
 		 * @param body pjlink command body (see spec)
 		 * @param value pjlink value (see spec)
+		 * @return if the command is queued, false when refused or when a connection can't be created
 		 */
-		void send(const char* body, const char* value)					{ send(std::make_unique<PJLinkCommand>(body, value)); }
+		bool send(const char* body, const char* value)					{ return send(std::make_unique<PJLinkCommand>(body, value)); }
+
+		/**
+		 * Validates the projector properties.
+		 * @param errorState the error if initialization fails
+		 * @return if initialization succeeded
+		 */
+		bool init(utility::ErrorState& errorState) override;
 
 		/**
 		 * Connects the projector if connect on startup is true.
+		 * All projectors of the pool that connect on startup are connected together, see PJLinkProjectorPool.
 		 * Called by core after initialization.
 		 * @param errorState the error if connecting fails
 		 */
 		bool start(utility::ErrorState& errorState) override;
 
 		/**
-		 * Disconnects the projector.
+		 * Starts disconnecting the projector, doesn't wait for the connection to close.
 		 * Called by core before destruction.
 		 */
 		void stop() override;
 
+		/**
+		 * Removes the projector from the pool startup schedule and waits
+		 * for the connection to close, at most until the pool shutdown deadline.
+		 */
+		void onDestroy() override;
+
+		/**
+		 * Returns the last known state of the projector, updated from received responses.
+		 * Lock-free (not wait-free) for readers: doesn't lock, but retries while a response is being applied. Safe to call from any thread.
+		 * @return last known projector state
+		 */
+		PJLinkProjectorState getState() const							{ return mState.load(); }
+
+		/**
+		 * @return total number of commands merged with a pending command, see 'Coalesce'
+		 */
+		nap::uint64 getCoalescedCount() const							{ return mCoalesced; }
+
+		/**
+		 * @return total number of pending commands dropped from the queue, see 'MaxTelemetry'
+		 */
+		nap::uint64 getDroppedCount() const								{ return mDropped; }
+
+		/**
+		 * @return total number of commands refused because the queue was full, see 'MaxQueueDepth'
+		 */
+		nap::uint64 getRejectedCount() const							{ return mRejected; }
+
+		/**
+		 * @return number of commands currently queued or in flight
+		 */
+		int getQueueDepth();
+
+		/**
+		 * @return current circuit breaker state, see 'CircuitBreaker'
+		 */
+		ECircuitState getCircuitState();
+
+		/**
+		 * @return total number of connections created
+		 */
+		nap::uint64 getConnectionCount() const							{ return mConnectionCount; }
+
+		/**
+		 * @return number of commands sent over a connection that was kept alive, instead of a new connection.
+		 */
+		nap::uint64 getReconnectsSaved() const							{ return mReconnectsSaved; }
+
+		/**
+		 * @return number of queries answered from cache or merged with the same query in flight, see 'CacheTTL'
+		 */
+		nap::uint64 getCacheHits() const								{ return mCacheHits; }
+
+		/**
+		 * @return number of cacheable queries sent to the projector, see 'CacheTTL'
+		 */
+		nap::uint64 getCacheMisses() const								{ return mCacheMisses; }
+
 		bool mConnect = false;									//< Property: 'ConnectOnStartup' Connect to projector on startup, startup will fail if connection can't be established
 		std::string mIPAddress = "192.168.0.1";					//< Property: 'IP Address' ip address of the projector on the network
+		bool mKeepAlive = false;								//< Property: 'KeepAlive' Keep the connection open by sending a query when idle
+		int mConnectTimeout = 5;								//< Property: 'ConnectTimeout' Max number of seconds to establish a connection, queued commands fail afterwards
+		bool mCoalesce = false;									//< Property: 'Coalesce' Merge pending commands: a set command replaces a pending set command with the same body, duplicate queries are sent once
+		int mResponseTimeout = 5;								//< Property: 'ResponseTimeout' Default max number of seconds to wait for a response, the command fails afterwards
+		int mMaxQueueDepth = 0;									//< Property: 'MaxQueueDepth' Max number of commands queued or in flight, 0 = unlimited
+		EQueuePolicy mQueuePolicy = EQueuePolicy::Reject;		//< Property: 'QueuePolicy' What to do with a command when the queue is full
+		bool mCircuitBreaker = false;							//< Property: 'CircuitBreaker' Fail commands immediately after a failed connection attempt, with exponential backoff between attempts
+		float mMinBackoff = 1.0f;								//< Property: 'MinBackoff' Seconds to wait after the first failed connection attempt
+		float mMaxBackoff = 60.0f;								//< Property: 'MaxBackoff' Max number of seconds to wait between connection attempts
+		bool mCoroutines = false;								//< Property: 'Coroutines' Drive the connection with a single C++20 coroutine instead of chained callbacks, requires coroutine support
+		int mMaxTelemetry = 0;									//< Property: 'MaxTelemetry' Max number of pending telemetry commands (queries), the oldest is dropped when exceeded, 0 = unlimited
+		float mPowerCacheTTL = 0.0f;							//< Property: 'PowerCacheTTL' Max age in seconds of a cached power query response, 0 = disabled
+		float mAVMuteCacheTTL = 0.0f;							//< Property: 'AVMuteCacheTTL' Max age in seconds of a cached mute query response, 0 = disabled
+		float mErrorCacheTTL = 0.0f;							//< Property: 'ErrorCacheTTL' Max age in seconds of a cached error status query response, 0 = disabled
+		float mLampCacheTTL = 0.0f;								//< Property: 'LampCacheTTL' Max age in seconds of a cached lamp query response, 0 = disabled
 		nap::ResourcePtr<PJLinkProjectorPool> mPool;			//< Property: 'Pool' Interface that manages the connection
 
 		/**
-		 * Called by the **network processing thread** after receiving a response.
+		 * Called by the **network processing thread** after receiving a response, or when the command failed.
+		 * Use PJLinkCommand::getState() to check if the command completed or failed.
 		 * Use PJLinkComponent::messageReceived to receive this message on the application thread.
 		 */
 		nap::Signal<const PJLinkCommand&> responseReceived;
 
+		/**
+		 * Called by the **network processing thread** after receiving a response, or when the command failed.
+		 * Receives the command as shared immutable object: all listeners share the same instance.
+		 */
+		nap::Signal<const PJLinkResponsePtr&> sharedResponseReceived;
+
 	private:
 		friend class PJLinkConnection;
+		friend class PJLinkProjectorPool;
+
+		// Creates a connection and starts connecting, the future is invalid when the connection can't be created
+		std::shared_future<bool> startConnect(utility::ErrorState& error);
+
+		// Waits for the disconnect started on stop, until the shutdown deadline
+		void waitDisconnect();
+		std::future<void> mDisconnected;							//< Resolves when the connection closed after stop
+		std::chrono::steady_clock::time_point mDisconnectDeadline;	//< Shared pool shutdown deadline
+
+		// Waits until all answers posted to the projector strand are delivered
+		void drain();
+		std::unique_ptr<pjlink::Strand> mStrand = nullptr;			//< Delivers cached and refused answers, runs on the projector thread
 
 		// Called by the PJLink client when connection is closed
-		void connectionClosed();
+		void connectionClosed(const PJLinkConnection& connection);
+
+		// Called by the PJLink client after a connection attempt, updates the circuit breaker
+		void connectionResult(bool success);
 
 		// Called by the PJLink client when it receives a message from the projector
-		void response(const PJLinkCommand& message);
+		void response(const PJLinkResponsePtr& message);
 
-		// Creates a connection
-		std::shared_ptr<PJLinkConnection> create(utility::ErrorState & error);
+		// Creates a connection, recycled by the pool when possible
+		std::shared_ptr<PJLinkConnection> create();
 
-		// Get current connection handle
+		// Get current connection handle, created when requested.
+		// Returns null when the circuit is open, or with error when the address is invalid.
 		std::shared_ptr<PJLinkConnection> getConnection(bool make, utility::ErrorState& error);
 
+		// Sends a command over the current connection, bypassing the cache
+		bool dispatch(PJLinkCommandPtr cmd, PJLinkCompletion completion);
+
+		// Fails the command without sending it, answered from the projector strand
+		void refuse(PJLinkCommandPtr cmd, PJLinkCompletion completion, PJLinkCommand::EState state);
+
+		// Single query in flight, shared by all requests waiting for it
+		struct Flight
+		{
+			rtti::TypeInfo mType = RTTI_OF(PJLinkCommand);			//< Query type
+			PJLinkCompletion mWaiting = nullptr;					//< Requests waiting for the query to complete
+		};
+
+		// Cached query of a specific body
+		struct CacheEntry
+		{
+			std::string_view mBody;									//< Query body, for example: 'POWR'
+			float mTTL = 0.0f;										//< Max age of cached response in seconds, 0 = disabled
+			PJLinkResponsePtr mResponse = nullptr;					//< Last completed response
+			std::chrono::steady_clock::time_point mTime;			//< Time the response was received
+			std::shared_ptr<Flight> mFlight = nullptr;				//< Query in flight, null if none
+		};
+
+		// Returns the enabled cache entry for the given command, nullptr if not cached
+		CacheEntry* findCacheEntry(const PJLinkCommand& cmd);
+
+		std::array<CacheEntry, 4> mCache;							//< Cached query responses
+		std::mutex mCacheMutex;										//< Guards the cache
+		std::atomic<nap::uint64> mCacheHits = { 0 };				//< Total number of queries answered without the connection
+		std::atomic<nap::uint64> mCacheMisses = { 0 };				//< Total number of cacheable queries sent
+
 		std::mutex mConnectionMutex;
+		pjlink::EndPoint mEndpoint;									//< Projector endpoint, parsed on init
+		int mWorker = 0;											//< Pool thread that runs all network operations of this projector, assigned on init
+		bool mValidAddress = false;									//< If the ip address could be parsed, connection attempts fail otherwise
 		std::shared_ptr<PJLinkConnection> mConnection = nullptr;	//< Client connection
+		ECircuitState mCircuit = ECircuitState::Closed;				//< Circuit breaker state, guarded by connection mutex
+		int mFailures = 0;											//< Number of consecutive failed connection attempts
+		std::chrono::steady_clock::time_point mRetryTime;			//< Time the circuit becomes half-open
+		std::atomic<nap::uint64> mConnectionCount = { 0 };			//< Total number of connections created
+		std::atomic<nap::uint64> mReconnectsSaved = { 0 };			//< Total number of reconnects saved by keep-alive
+		std::atomic<nap::uint64> mCoalesced = { 0 };				//< Total number of commands merged with a pending command
+		std::atomic<nap::uint64> mDropped = { 0 };					//< Total number of pending commands dropped from the queue
+		std::atomic<nap::uint64> mRejected = { 0 };					//< Total number of commands refused because the queue was full
+
+		// Updates the last known state from a completed command
+		void updateState(const PJLinkCommand& command);
+		pjlink::SeqLock<PJLinkProjectorState> mState;				//< Last known state
+		std::mutex mStateMutex;										//< Serializes state writers (network threads)
 	};
 }
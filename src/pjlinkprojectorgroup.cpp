@@ -0,0 +1,106 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Local includes
+#include "pjlinkprojectorgroup.h"
+
+// External includes
+#include <atomic>
+#include <algorithm>
+
+RTTI_BEGIN_CLASS(nap::PJLinkProjectorGroup)
+	RTTI_PROPERTY("Projectors", &nap::PJLinkProjectorGroup::mProjectors, nap::rtti::EPropertyMetaData::Default, "All projectors in the group")
+	RTTI_PROPERTY("MaxConcurrent", &nap::PJLinkProjectorGroup::mMaxConcurrent, nap::rtti::EPropertyMetaData::Default, "Max number of commands in flight at the same time")
+RTTI_END_CLASS
+
+namespace nap
+{
+	/**
+	 * Shared state of a single group send operation
+	 */
+	struct PJLinkProjectorGroup::Broadcast
+	{
+		PJLinkCommandPtr mPrototype;						//< Command without response, shares the encoded payload
+		std::vector<PJLinkProjector*> mTargets;				//< Projectors to send to
+		Results mResults;									//< Result for every projector
+		Completion mCompletion;								//< Called after all projectors completed or failed
+		size_t mNext = 0;									//< Next projector to dispatch to, only accessed by the dispatching thread
+		std::atomic<size_t> mRequests = { 0 };				//< Number of dispatches requested and not yet handled
+		std::atomic<size_t> mDone = { 0 };					//< Number of completed projectors
+	};
+
+
+	bool PJLinkProjectorGroup::init(utility::ErrorState& errorState)
+	{
+		if (!errorState.check(mMaxConcurrent > 0, "%s: invalid max concurrent: %d", mID.c_str(), mMaxConcurrent))
+			return false;
+		return true;
+	}
+
+
+	void PJLinkProjectorGroup::send(const PJLinkCommand& cmd, Completion completion)
+	{
+		// Nothing to send to
+		if (mProjectors.empty())
+		{
+			if (completion)
+				completion({});
+			return;
+		}
+
+		// Create shared broadcast state
+		auto broadcast = std::make_shared<Broadcast>();
+		broadcast->mPrototype = cmd.clone();
+		broadcast->mPrototype->share(std::make_shared<const pjlink::Message>(cmd.getMessage()));
+		broadcast->mCompletion = std::move(completion);
+		broadcast->mResults.resize(mProjectors.size());
+		broadcast->mTargets.reserve(mProjectors.size());
+		for (const auto& projector : mProjectors)
+			broadcast->mTargets.emplace_back(projector.get());
+
+		// Start first batch -> every completion dispatches the next projector
+		dispatch(broadcast, std::min<size_t>(mMaxConcurrent, mProjectors.size()));
+	}
+
+
+	std::future<PJLinkProjectorGroup::Results> PJLinkProjectorGroup::request(const PJLinkCommand& cmd)
+	{
+		// Completion handler must be copyable -> share promise
+		auto promise = std::make_shared<std::promise<Results>>();
+		auto future = promise->get_future();
+		send(cmd, [promise](Results results)
+			{
+				promise->set_value(std::move(results));
+			});
+		return future;
+	}
+
+
+	void PJLinkProjectorGroup::dispatch(const std::shared_ptr<Broadcast>& broadcast, size_t count)
+	{
+		// Already dispatching -> the dispatching thread handles the request.
+		// Commands that fail immediately complete from within send(), which only adds a request: no recursion.
+		if (broadcast->mRequests.fetch_add(count) > 0)
+			return;
+
+		do
+		{
+			// Claim next projector, skip if all have been dispatched
+			auto index = broadcast->mNext++;
+			if (index >= broadcast->mTargets.size())
+				continue;
+
+			broadcast->mTargets[index]->send(broadcast->mPrototype->clone(), [broadcast, index](const PJLinkResponsePtr& result)
+				{
+					// Store result and dispatch next
+					broadcast->mResults[index] = result;
+					dispatch(broadcast, 1);
+
+					// Notify when all projectors completed
+					if (++broadcast->mDone == broadcast->mTargets.size() && broadcast->mCompletion)
+						broadcast->mCompletion(std::move(broadcast->mResults));
+				});
+		} while (broadcast->mRequests.fetch_sub(1) > 1);
+	}
+}
@@ -0,0 +1,88 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// Local includes
+#include "pjlinkprojector.h"
+
+// External includes
+#include <nap/resource.h>
+#include <nap/resourceptr.h>
+#include <vector>
+#include <future>
+
+namespace nap
+{
+	/**
+	 * Sends a single PJLink command to a group of projectors.
+	 *
+	 * The command is encoded once: all projectors send the same immutable payload, every projector receives its own response.
+	 * No more than 'MaxConcurrent' commands are in flight at the same time, which bounds the number of 
+	 * concurrent connection attempts when powering on a large venue. 
+	 *
+	 * The completion handler is called once, from the **network processing thread**, after all projectors completed or failed.
+	 * It receives a result for every projector, in the same order as the 'Projectors' property.
+	 */
+	class NAPAPI PJLinkProjectorGroup : public Resource
+	{
+		RTTI_ENABLE(Resource)
+	public:
+		// Command result for every projector, ordered as the 'Projectors' property
+		using Results = std::vector<PJLinkResponsePtr>;
+
+		// Called after all projectors completed or failed
+		using Completion = std::function<void(Results)>;
+
+		/**
+		 * Validates the group
+		 * @param errorState the error if initialization fails
+		 * @return if initialization succeeded
+		 */
+		bool init(utility::ErrorState& errorState) override;
+
+		/**
+		 * Turns all projectors on
+		 */
+		void powerOn()													{ send(PJLinkSetPowerCommand(true), nullptr); }
+
+		/**
+		 * Turns all projectors off
+		 */
+		void powerOff()													{ send(PJLinkSetPowerCommand(false), nullptr); }
+
+		/**
+		 * Mute audio and video output of all projectors.
+		 */
+		void muteOn()													{ send(PJLinkSetAVMuteCommand(true), nullptr); }
+
+		/**
+		 * Don't mute audio and video output of all projectors.
+		 */
+		void muteOff()													{ send(PJLinkSetAVMuteCommand(false), nullptr); }
+
+		/**
+		 * Sends a PJLink command to all projectors in the group a-sync.
+		 * This function returns immediately, the commands are queued.
+		 * @param cmd command to send, copied for every projector
+		 * @param completion called after all projectors completed or failed, can be null
+		 */
+		void send(const PJLinkCommand& cmd, Completion completion);
+
+		/**
+		 * Sends a PJLink command to all projectors in the group a-sync.
+		 * This function returns immediately, the commands are queued.
+		 * @param cmd command to send, copied for every projector
+		 * @return result for every projector, available after all projectors completed or failed
+		 */
+		std::future<Results> request(const PJLinkCommand& cmd);
+
+		std::vector<nap::ResourcePtr<PJLinkProjector>> mProjectors;		//< Property: 'Projectors' All projectors in the group
+		int mMaxConcurrent = 16;										//< Property: 'MaxConcurrent' Max number of commands in flight at the same time
+
+	private:
+		struct Broadcast;
+		static void dispatch(const std::shared_ptr<Broadcast>& broadcast, size_t count);
+	};
+}
@@ -5,46 +5,399 @@
 // Local includes
 #include "pjlinkprojectorpool.h"
 #include "pjlinkprojector.h"
+#include "pjlinkconnection.h"
 #include "pjlinkcommand.h"
 
 // External includes
 #include <asio/write.hpp>
 #include <asio/buffer.hpp>
+#include <asio/post.hpp>
+#include <asio/use_future.hpp>
 #include <nap/logger.h>
 #include <iterator>
+#include <algorithm>
 
 RTTI_BEGIN_CLASS(nap::PJLinkProjectorPool)
+	RTTI_PROPERTY("ThreadCount", &nap::PJLinkProjectorPool::mThreadCount, nap::rtti::EPropertyMetaData::Default, "Number of network threads, every thread runs its own context")
+	RTTI_PROPERTY("PowerPollInterval", &nap::PJLinkProjectorPool::mPowerPollInterval, nap::rtti::EPropertyMetaData::Default, "Seconds between power status polls of a projector, 0 disables polling")
+	RTTI_PROPERTY("ErrorPollInterval", &nap::PJLinkProjectorPool::mErrorPollInterval, nap::rtti::EPropertyMetaData::Default, "Seconds between error status polls of a projector, 0 disables polling")
+	RTTI_PROPERTY("LampPollInterval", &nap::PJLinkProjectorPool::mLampPollInterval, nap::rtti::EPropertyMetaData::Default, "Seconds between lamp status polls of a projector, 0 disables polling")
+	RTTI_PROPERTY("PollJitter", &nap::PJLinkProjectorPool::mPollJitter, nap::rtti::EPropertyMetaData::Default, "Random deviation (0-1) of the time between two consecutive polls")
+	RTTI_PROPERTY("MaxPollsInFlight", &nap::PJLinkProjectorPool::mMaxPollsInFlight, nap::rtti::EPropertyMetaData::Default, "Max number of polls waiting for a response, subsequent polls are skipped")
+	RTTI_PROPERTY("ShutdownTimeout", &nap::PJLinkProjectorPool::mShutdownTimeout, nap::rtti::EPropertyMetaData::Default, "Max number of seconds to wait for all connections to close, shared by all projectors that stop together")
 RTTI_END_CLASS
 
+RTTI_BEGIN_ENUM(nap::PJLinkProjectorPool::EStartupResult)
+	RTTI_ENUM_VALUE(nap::PJLinkProjectorPool::EStartupResult::Connected,	"Connected"),
+	RTTI_ENUM_VALUE(nap::PJLinkProjectorPool::EStartupResult::Failed,		"Failed"),
+	RTTI_ENUM_VALUE(nap::PJLinkProjectorPool::EStartupResult::TimedOut,		"Timed Out")
+RTTI_END_ENUM
+
 namespace nap
 {
 	bool PJLinkProjectorPool::init(utility::ErrorState& error)
 	{
-		assert(mThread == nullptr);
-		assert(mGuard  == nullptr);
-		mGuard  = std::make_unique<pjlink::Guard>(asio::make_work_guard(mContext));
-		mThread = std::make_unique<std::thread>([this]
+		assert(mWorkers.empty());
+		if (!error.check(mThreadCount > 0, "%s: invalid thread count: %d", mID.c_str(), mThreadCount))
+			return false;
+
+		if (!error.check(mPowerPollInterval >= 0.0f && mErrorPollInterval >= 0.0f && mLampPollInterval >= 0.0f,
+			"%s: invalid poll interval", mID.c_str()))
+			return false;
+
+		if (!error.check(mPollJitter >= 0.0f && mPollJitter <= 1.0f, "%s: invalid poll jitter: %.2f", mID.c_str(), mPollJitter))
+			return false;
+
+		if (!error.check(mMaxPollsInFlight > 0, "%s: invalid max polls in flight: %d", mID.c_str(), mMaxPollsInFlight))
+			return false;
+
+		if (!error.check(mShutdownTimeout > 0.0f, "%s: invalid shutdown timeout: %.2f", mID.c_str(), mShutdownTimeout))
+			return false;
+
+		// Create a context per thread -> operations of a projector always run on the same thread
+		mWorkers.reserve(mThreadCount);
+		for (int i = 0; i < mThreadCount; i++)
+			mWorkers.emplace_back(std::make_unique<Worker>());
+
+		// Create poll schedules
+		mPollStrand = std::make_unique<pjlink::Strand>(asio::make_strand(mWorkers.front()->mContext));
+		if (mPowerPollInterval > 0.0f)
+			mPolls.emplace_back(std::make_unique<Poll>(*mPollStrand, [] { return std::make_unique<PJLinkGetPowerCommand>(); }, mPowerPollInterval));
+		if (mErrorPollInterval > 0.0f)
+			mPolls.emplace_back(std::make_unique<Poll>(*mPollStrand, [] { return std::make_unique<PJLinkGetErrorStatusCommand>(); }, mErrorPollInterval));
+		if (mLampPollInterval > 0.0f)
+			mPolls.emplace_back(std::make_unique<Poll>(*mPollStrand, [] { return std::make_unique<PJLinkGetLampStatusCommand>(); }, mLampPollInterval));
+
+		for (auto& worker : mWorkers)
+		{
+			auto& context = worker->mContext;
+			worker->mGuard = std::make_unique<pjlink::Guard>(asio::make_work_guard(context));
+			worker->mThread = std::thread([&context]
+				{
+					// Run until guard is reset or context is stopped
+					context.run();
+				}
+			);
+		}
+		mRunning = true;
+
+		// Start polling -> random start offset prevents schedules from firing at the same time
+		asio::post(*mPollStrand, [this]
 			{
-				// Run until guard is reset or context is stopped.
-				// All handlers will be called from within this thread.
-				this->mContext.run();
-			}
-		);
+				mPolling = true;
+				std::uniform_real_distribution<double> offset(0.0, 1.0);
+				for (auto& poll : mPolls)
+					schedule(*poll, poll->mInterval * offset(mRandom));
+			});
 		return true;
 	}
 
 
+	PJLinkProjectorPool::~PJLinkProjectorPool()
+	{
+		// Stop recycling -> connections released from here on stay in their slot
+		{
+			std::lock_guard<std::mutex> lock(mFreeMutex);
+			mRecycle = false;
+			for (auto& worker : mWorkers)
+				worker->mFreeSlots.clear();
+		}
+
+		// Destroy operations that are still outstanding when the contexts were stopped.
+		// Their handlers release the last connection handles and return operation memory to the connections.
+		for (auto& worker : mWorkers)
+			worker->mContext.shutdown();
+
+		// Delete all connections -> no handle is left, the socket and timer services are still available
+		for (auto& slot : mSlots)
+			slot->mConnection.reset();
+	}
+
+
 	void PJLinkProjectorPool::onDestroy()
 	{
-		if (mThread != nullptr)
+		if (mRunning)
+		{
+			// Stop polling -> outstanding timers would keep the context running
+			asio::post(*mPollStrand, asio::use_future([this]
+				{
+					mPolling = false;
+					for (auto& poll : mPolls)
+						poll->mTimer.cancel();
+				})).wait();
+			mPolls.clear();
+
+			// Connections didn't close in time -> cancel all outstanding work
+			if (mShutdownStalled)
+			{
+				nap::Logger::warn("%s: Cancelling outstanding network operations", mID.c_str());
+				for (auto& worker : mWorkers)
+					worker->mContext.stop();
+			}
+
+			// Contexts are kept, outstanding operations are destroyed on destruction
+			for (auto& worker : mWorkers)
+				worker->mGuard->reset();
+			for (auto& worker : mWorkers)
+			{
+				worker->mThread.join();
+				worker->mGuard.reset(nullptr);
+			}
+			mRunning = false;
+		}
+	}
+
+
+	int PJLinkProjectorPool::assignWorker()
+	{
+		assert(!mWorkers.empty());
+		return mNextWorker++ % static_cast<int>(mWorkers.size());
+	}
+
+
+	void PJLinkProjectorPool::registerProjector(PJLinkProjector& projector)
+	{
+		std::lock_guard<std::mutex> lock(mProjectorMutex);
+		assert(std::find(mProjectors.begin(), mProjectors.end(), &projector) == mProjectors.end());
+		mProjectors.emplace_back(&projector);
+	}
+
+
+	void PJLinkProjectorPool::unregisterProjector(PJLinkProjector& projector)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mProjectorMutex);
+			auto it = std::find(mProjectors.begin(), mProjectors.end(), &projector);
+			if (it != mProjectors.end())
+				mProjectors.erase(it);
+		}
+
+		// Wait for a poll that selected the projector before it was removed -> polls run in order on the poll strand
+		if (mRunning)
+			asio::post(*mPollStrand, asio::use_future([] {})).wait();
+	}
+
+
+	std::shared_ptr<PJLinkConnection> PJLinkProjectorPool::acquireConnection(PJLinkProjector& projector)
+	{
+		// Connections are recycled per worker -> the connection runs on the thread of the projector
+		auto& worker = *mWorkers[projector.mWorker];
+		Slot* slot = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mFreeMutex);
+			if (!worker.mFreeSlots.empty())
+			{
+				slot = worker.mFreeSlots.back();
+				worker.mFreeSlots.pop_back();
+			}
+			else
+			{
+				// Create new connection when none is available
+				mSlots.emplace_back(std::make_unique<Slot>());
+				slot = mSlots.back().get();
+				slot->mWorker = &worker;
+				slot->mConnection.reset(new PJLinkConnection(worker.mContext));
+			}
+		}
+
+		// Control block is allocated from slot memory -> a recycled connection allocates nothing
+		slot->mConnection->reset(projector);
+		return std::shared_ptr<PJLinkConnection>(slot->mConnection.get(), [this, slot](PJLinkConnection*)
+			{
+				recycle(*slot);
+			}, pjlink::HandlerAllocator<PJLinkConnection, Slot::Memory>(slot->mMemory));
+	}
+
+
+	void PJLinkProjectorPool::recycle(Slot& slot)
+	{
+		// Connections are deleted by the pool once recycling stops, never from within a handler:
+		// the handler that releases the last handle still returns its memory to the connection.
+		std::lock_guard<std::mutex> lock(mFreeMutex);
+		if (mRecycle)
+			slot.mWorker->mFreeSlots.emplace_back(&slot);
+	}
+
+
+	nap::uint64 PJLinkProjectorPool::getFallbackCount()
+	{
+		std::lock_guard<std::mutex> lock(mFreeMutex);
+		nap::uint64 count = 0;
+		for (const auto& slot : mSlots)
 		{
-			assert(mGuard != nullptr);
-			mGuard->reset();;
-			mThread->join();
+			count += slot->mMemory.getFallbackCount();
+			if (slot->mConnection != nullptr)
+				count += slot->mConnection->getFallbackCount();
+		}
+		return count;
+	}
+
+
+	void PJLinkProjectorPool::addStartup(PJLinkProjector& projector)
+	{
+		std::lock_guard<std::mutex> lock(mStartupMutex);
+		assert(std::find(mStartup.begin(), mStartup.end(), &projector) == mStartup.end());
+		mStartup.emplace_back(&projector);
+	}
 
-			mThread.reset(nullptr);
-			mGuard.reset(nullptr);
 
+	void PJLinkProjectorPool::removeStartup(PJLinkProjector& projector)
+	{
+		std::lock_guard<std::mutex> lock(mStartupMutex);
+		auto it = std::find(mStartup.begin(), mStartup.end(), &projector);
+		if (it != mStartup.end())
+			mStartup.erase(it);
+
+		auto batch = std::find(mBatch.begin(), mBatch.end(), &projector);
+		if (batch != mBatch.end())
+			mBatch.erase(batch);
+	}
+
+
+	bool PJLinkProjectorPool::connectOnStartup(PJLinkProjector& projector, utility::ErrorState& error)
+	{
+		std::lock_guard<std::mutex> lock(mStartupMutex);
+		auto batched = std::find(mBatch.begin(), mBatch.end(), &projector);
+		if (batched == mBatch.end())
+		{
+			// Not connected by the last batch -> connect all projectors that are stopped, started projectors keep their connection
+			mBatch.clear();
+			{
+				std::lock_guard<std::mutex> projector_lock(mProjectorMutex);
+				std::copy_if(mStartup.begin(), mStartup.end(), std::back_inserter(mBatch), [this](PJLinkProjector* candidate)
+					{
+						return std::find(mProjectors.begin(), mProjectors.end(), candidate) == mProjectors.end();
+					});
+			}
+
+			// Previous connections must be closed before they are replaced
+			for (auto* candidate : mBatch)
+				candidate->waitDisconnect();
+
+			// Start all connections at once -> the deadline is shared by all projectors
+			struct Attempt
+			{
+				PJLinkProjector* mProjector;
+				std::shared_future<bool> mConnected;
+			};
+			std::vector<Attempt> attempts;
+			attempts.reserve(mBatch.size());
+
+			auto start = std::chrono::steady_clock::now();
+			auto deadline = start;
+			for (auto* candidate : mBatch)
+			{
+				utility::ErrorState connect_error;
+				attempts.emplace_back(Attempt{ candidate, candidate->startConnect(connect_error) });
+				if (connect_error.hasErrors())
+					nap::Logger::error(connect_error.toString());
+				deadline = std::max(deadline, start + nap::Seconds(candidate->mConnectTimeout + PJLinkConnection::sAuthTimeout + 1));
+			}
+
+			// Wait for all connections together -> the report only contains this batch
+			mStartupReport.clear();
+			int connected = 0;
+			for (auto& attempt : attempts)
+			{
+				auto* candidate = attempt.mProjector;
+				auto it = mStartupReport.emplace(mStartupReport.end());
+				it->mProjector = candidate->mID;
+				it->mIPAddress = candidate->mIPAddress;
+				if (!attempt.mConnected.valid())
+					it->mResult = EStartupResult::Failed;
+				else if (attempt.mConnected.wait_until(deadline) != std::future_status::ready)
+					it->mResult = EStartupResult::TimedOut;
+				else
+					it->mResult = attempt.mConnected.get() ? EStartupResult::Connected : EStartupResult::Failed;
+				connected += it->mResult == EStartupResult::Connected ? 1 : 0;
+			}
+
+			nap::Logger::info("%s: Connected %d of %d projector(s) in %.2f second(s)", mID.c_str(), connected,
+				static_cast<int>(attempts.size()), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
 		}
+
+		// Get result of projector, consumed on start
+		batched = std::find(mBatch.begin(), mBatch.end(), &projector);
+		if (batched != mBatch.end())
+			mBatch.erase(batched);
+
+		auto it = std::find_if(mStartupReport.begin(), mStartupReport.end(), [&projector](const StartupReport& report)
+			{
+				return report.mProjector == projector.mID;
+			});
+		if (!error.check(it != mStartupReport.end(), "%s: projector '%s' not scheduled to connect on startup", mID.c_str(), projector.mID.c_str()))
+			return false;
+
+		if (!error.check(it->mResult != EStartupResult::TimedOut, "Connection to endpoint '%s' timed out", projector.mIPAddress.c_str()))
+			return false;
+
+		return error.check(it->mResult == EStartupResult::Connected, "Unable to connect to endpoint '%s'", projector.mIPAddress.c_str());
+	}
+
+
+	std::chrono::steady_clock::time_point PJLinkProjectorPool::beginShutdown()
+	{
+		// Start a new deadline when the previous one expired
+		std::lock_guard<std::mutex> lock(mShutdownMutex);
+		auto now = std::chrono::steady_clock::now();
+		if (now >= mShutdownDeadline)
+			mShutdownDeadline = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(mShutdownTimeout));
+		return mShutdownDeadline;
+	}
+
+
+	std::vector<PJLinkProjectorPool::StartupReport> PJLinkProjectorPool::getStartupReport()
+	{
+		std::lock_guard<std::mutex> lock(mStartupMutex);
+		return mStartupReport;
+	}
+
+
+	void PJLinkProjectorPool::poll(Poll& poll)
+	{
+		// Select next projector, projectors are spread evenly across the interval
+		double delay = poll.mInterval;
+		PJLinkProjector* projector = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mProjectorMutex);
+			if (!mProjectors.empty())
+			{
+				delay = poll.mInterval / static_cast<double>(mProjectors.size());
+				projector = mProjectors[poll.mCursor++ % mProjectors.size()];
+			}
+		}
+
+		// Send without holding the projector lock -> unregistering waits for this handler to complete
+		if (projector != nullptr)
+		{
+			if (mPollsInFlight < mMaxPollsInFlight)
+			{
+				mPollsInFlight++;
+				projector->send(poll.mCreate(), [this](const PJLinkResponsePtr&)
+					{
+						mPollsInFlight--;
+					});
+			}
+			else
+			{
+				nap::Logger::debug("%s: Too many polls in flight, skipping poll of '%s'",
+					mID.c_str(), projector->mID.c_str());
+			}
+		}
+
+		// Schedule next poll, including jitter
+		std::uniform_real_distribution<double> jitter(-mPollJitter, mPollJitter);
+		schedule(poll, delay * (1.0 + jitter(mRandom)));
+	}
+
+
+	void PJLinkProjectorPool::schedule(Poll& poll, double delay)
+	{
+		poll.mTimer.expires_after(std::chrono::duration_cast<pjlink::Timer::duration>(std::chrono::duration<double>(delay)));
+		poll.mTimer.async_wait([this, &poll](std::error_code ec)
+			{
+				if (!ec && mPolling)
+					this->poll(poll);
+			});
 	}
 }
@@ -4,6 +4,9 @@
 
 #pragma once
 
+// Local includes
+#include "pjlinkhandlermemory.h"
+
 // External includes
 #include <nap/device.h>
 #include <nap/resourceptr.h>
@@ -11,15 +14,39 @@
 #include <asio/io_context.hpp>
 #include <asio/executor_work_guard.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/strand.hpp>
+#include <asio/steady_timer.hpp>
 #include <thread>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <functional>
+#include <string>
+#include <chrono>
 
 namespace nap
 {
 	class PJLinkProjector;
+	class PJLinkCommand;
+	class PJLinkConnection;
 	namespace pjlink
 	{
-		using Context = asio::io_context;
+		/**
+		 * Asio runtime context, outstanding operations can be destroyed before the context itself is destroyed
+		 */
+		class Context : public asio::io_context
+		{
+		public:
+			using asio::io_context::io_context;
+
+			// Destroys all outstanding operations, including their handlers, and shuts down all services
+			using asio::io_context::shutdown;
+		};
+
 		using Guard = asio::executor_work_guard<Context::executor_type>;
+		using Strand = asio::strand<Context::executor_type>;
+		using Timer = asio::basic_waitable_timer<std::chrono::steady_clock, asio::wait_traits<std::chrono::steady_clock>, Strand>;
 		using EndPoint = asio::ip::tcp::endpoint;
 		using Address = asio::ip::address;
 	}
@@ -28,8 +55,23 @@ namespace nap
 	 * PJLink shared runtime context.
 	 *
 	 * Runs all queued I/O network requests a-synchronous for all assigned projectors,
-	 * on an assigned worker thread.
-
+	 * on one or more ('ThreadCount') assigned worker threads.
+	 * Every thread runs its own context, projectors are distributed evenly across threads:
+	 * all network operations of a projector run on the same thread, never concurrently.
+	 * Memory released by an operation is therefore re-used by the next operation on the same thread.
+	 *
+	 * The pool can poll the status (power, error, lamp) of all its projectors at a fixed interval.
+	 * Every projector is polled once per interval, projectors are spread evenly (including jitter) across the interval.
+	 * Polls are skipped when more than 'MaxPollsInFlight' polls are waiting for a response.
+	 * Poll responses are forwarded to listeners of the projector, similar to all other responses.
+	 *
+	 * Projectors that stop together disconnect in parallel, against a single 'ShutdownTimeout'.
+	 * Outstanding work is cancelled on destruction when connections aren't closed in time.
+	 *
+	 * Projectors that 'ConnectOnStartup' are connected together: the first projector to start connects all stopped projectors at once
+	 * and waits for all connections against a single deadline. The batch is rebuilt on every start, including a restart without re-initialization.
+	 * Use getStartupReport() to see the result per projector.
+	 *
 	 * Every projector is required to be assigned to a pool.
 	 * Having more than 1 pool in your application is often not beneficial, unless
 	 * you are controlling more than 100 projectors ;) 
@@ -38,9 +80,32 @@ namespace nap
 	{
 		RTTI_ENABLE(Resource)
     public:
+		/**
+		 * Connection result of a single projector on startup
+		 */
+		enum class EStartupResult : nap::uint8
+		{
+			Connected	= 0,		//< Connection established and authenticated
+			Failed		= 1,		//< Connection refused or authentication failed
+			TimedOut	= 2			//< Connection not established before the shared deadline
+		};
+
+		/**
+		 * Startup report entry of a single projector, see getStartupReport()
+		 */
+		struct StartupReport
+		{
+			std::string mProjector;								//< Projector ID
+			std::string mIPAddress;								//< Projector IP address
+			EStartupResult mResult = EStartupResult::Failed;	//< Connection result
+		};
+
 		// Default constructor
 		PJLinkProjectorPool() = default;
 
+		// Destroys outstanding operations and deletes all connections
+		~PJLinkProjectorPool() override;
+
 		/**
 		 * Creates the network context
 		 * @param error error if initialization fails
@@ -53,13 +118,124 @@ namespace nap
 		 */
 		void onDestroy() override;
 
+		/**
+		 * Returns the connection result of all projectors that connected together on the last start.
+		 * Available after the first projector started.
+		 * @return startup report, one entry per projector
+		 */
+		std::vector<StartupReport> getStartupReport();
+
+		/**
+		 * Returns the number of allocations made by connection operations that weren't served from recycled connection memory.
+		 * Stays constant while callback driven connections exchange commands in a steady state, safe to call from any thread.
+		 * Coroutine driven connections allocate their operations from the per-thread cache of asio instead, which isn't counted.
+		 * @return number of allocations served by the global allocator, of all connections of this pool
+		 */
+		nap::uint64 getFallbackCount();
+
+		int mThreadCount = 1;								//< Property: 'ThreadCount' Number of network threads, every thread runs its own context
+		float mPowerPollInterval = 0.0f;					//< Property: 'PowerPollInterval' Seconds between power status polls of a projector, 0 disables polling
+		float mErrorPollInterval = 0.0f;					//< Property: 'ErrorPollInterval' Seconds between error status polls of a projector, 0 disables polling
+		float mLampPollInterval = 0.0f;						//< Property: 'LampPollInterval' Seconds between lamp status polls of a projector, 0 disables polling
+		float mPollJitter = 0.1f;							//< Property: 'PollJitter' Random deviation (0-1) of the time between two consecutive polls
+		int mMaxPollsInFlight = 32;							//< Property: 'MaxPollsInFlight' Max number of polls waiting for a response, subsequent polls are skipped
+		float mShutdownTimeout = 5.0f;						//< Property: 'ShutdownTimeout' Max number of seconds to wait for all connections to close, shared by all projectors that stop together
+
 	private:
 		friend class PJLinkProjector;
 
-		// Attempt to disconnect
-		pjlink::Context mContext;							//< Asio runtime context
-		std::unique_ptr<pjlink::Guard> mGuard = nullptr;	//< Asio work guard
-		std::unique_ptr<std::thread> mThread  = nullptr;	//< Asio runtime thread
-		
-    };
+		// Single command poll schedule
+		struct Poll
+		{
+			Poll(const pjlink::Strand& strand, std::function<std::unique_ptr<PJLinkCommand>()> create, double interval) :
+				mTimer(strand), mCreate(std::move(create)), mInterval(interval) { }
+
+			pjlink::Timer mTimer;												//< Schedules next poll
+			std::function<std::unique_ptr<PJLinkCommand>()> mCreate;			//< Creates the poll command
+			double mInterval;													//< Poll interval of a single projector in seconds
+			size_t mCursor = 0;													//< Next projector to poll
+		};
+
+		// Called by the projector on init, returns the index of the thread that runs all network operations of the projector
+		int assignWorker();
+
+		// Returns the context of the given worker thread
+		pjlink::Context& getContext(int worker)				{ return mWorkers[worker]->mContext; }
+
+		// Called by the projector on start and stop
+		void registerProjector(PJLinkProjector& projector);
+		void unregisterProjector(PJLinkProjector& projector);
+
+		// Called by the projector on init and destruction, when it connects on startup
+		void addStartup(PJLinkProjector& projector);
+		void removeStartup(PJLinkProjector& projector);
+
+		// Called by the projector on start, connects all stopped projectors together and returns the result of the given projector
+		bool connectOnStartup(PJLinkProjector& projector, utility::ErrorState& error);
+
+		// Called by the projector on stop, returns the shutdown deadline shared by all projectors that stop together
+		std::chrono::steady_clock::time_point beginShutdown();
+
+		// Called from poll strand
+		void poll(Poll& poll);
+		void schedule(Poll& poll, double delay);
+
+		struct Worker;
+
+		// Recyclable connection, including the memory the control block of its handle is allocated from.
+		// The memory outlives the connection: the control block is released after the connection is deleted.
+		// Connections are deleted on destruction of the pool, after all outstanding operations are destroyed.
+		struct Slot
+		{
+			using Memory = pjlink::BasicHandlerMemory<128, 2>;
+			Memory mMemory;												//< Handle control block memory, the previous block is released after the next one is allocated
+			std::unique_ptr<PJLinkConnection> mConnection;				//< Recycled connection
+			Worker* mWorker = nullptr;									//< Worker that runs the connection, the connection is only recycled by projectors of the same worker
+		};
+
+		// Single network thread that runs its own context
+		struct Worker
+		{
+			pjlink::Context mContext { 1 };								//< Asio runtime context, run by a single thread
+			std::unique_ptr<pjlink::Guard> mGuard = nullptr;			//< Asio work guard
+			std::thread mThread;										//< Asio runtime thread
+			std::vector<Slot*> mFreeSlots;								//< Slots available for re-use, guarded by free mutex
+		};
+
+		// Returns a connection for the projector, recycled when available
+		std::shared_ptr<PJLinkConnection> acquireConnection(PJLinkProjector& projector);
+
+		// Called when the last handle to a connection is released
+		void recycle(Slot& slot);
+
+		// Recycled connections -> declared before the contexts, connections can be released while the contexts are destroyed
+		std::vector<std::unique_ptr<Slot>> mSlots;			//< All connection slots, guarded by free mutex
+		std::mutex mFreeMutex;								//< Guards recycled connections
+		bool mRecycle = true;								//< If released connections are recycled, guarded by free mutex
+
+		// Network threads
+		std::vector<std::unique_ptr<Worker>> mWorkers;		//< All network threads, including their context
+		std::atomic<int> mNextWorker = { 0 };				//< Worker assigned to the next projector
+		bool mRunning = false;								//< If the network threads are running
+
+		// Polling
+		std::unique_ptr<pjlink::Strand> mPollStrand = nullptr;		//< Serializes all poll handlers, runs on the first worker
+		std::vector<std::unique_ptr<Poll>> mPolls;					//< All active poll schedules
+		bool mPolling = false;										//< If polling is active, accessed from poll strand
+		std::mt19937 mRandom { std::random_device{}() };			//< Poll jitter generator, accessed from poll strand
+		std::atomic<int> mPollsInFlight = { 0 };					//< Number of polls waiting for a response
+		std::vector<PJLinkProjector*> mProjectors;					//< All registered projectors
+		std::mutex mProjectorMutex;									//< Guards registered projectors, not held while polling
+
+		// Startup
+		std::vector<PJLinkProjector*> mStartup;						//< All projectors that connect on startup
+		std::vector<PJLinkProjector*> mBatch;						//< Projectors connected by the last batch that didn't start yet
+		std::vector<StartupReport> mStartupReport;					//< Connection result of every projector of the last batch
+		std::mutex mStartupMutex;									//< Guards startup projectors and report
+
+		// Shutdown
+		std::chrono::steady_clock::time_point mShutdownDeadline;	//< Deadline shared by all projectors that stop together
+		std::mutex mShutdownMutex;									//< Guards shutdown deadline
+		std::atomic<bool> mShutdownStalled = { false };				//< If a connection didn't close before the deadline
+	};
 }
@@ -0,0 +1,88 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// Local includes
+#include "pjlinkcommand.h"
+
+// External includes
+#include <atomic>
+#include <array>
+#include <cstring>
+#include <type_traits>
+
+namespace nap
+{
+	/**
+	 * Last known state of a projector, updated from parsed projector responses.
+	 */
+	struct PJLinkProjectorState
+	{
+		PJLinkGetPowerCommand::EStatus mPower = PJLinkGetPowerCommand::EStatus::Unknown;		//< Last known power status
+		PJLinkGetAVMuteCommand::EStatus mAVMute = PJLinkGetAVMuteCommand::EStatus::Unknown;		//< Last known audio & video mute status
+		nap::uint16 mErrors = static_cast<nap::uint16>(PJLinkGetErrorStatusCommand::EStatus::Unknown);		//< Last known error bitmask
+		nap::uint16 mWarnings = static_cast<nap::uint16>(PJLinkGetErrorStatusCommand::EStatus::Unknown);	//< Last known warning bitmask
+		int mLampHours = -1;					//< Last known lamp hours, -1 if unknown
+		nap::uint32 mRevision = 0;				//< Incremented on every update
+	};
+
+
+	namespace pjlink
+	{
+		/**
+		 * Sequence lock around a trivially copyable value.
+		 * Readers are lock-free, not wait-free: they never take a lock or write shared memory, but retry when a write is in progress.
+		 * Writes must be serialized by the caller.
+		 */
+		template<typename T>
+		class SeqLock
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "SeqLock value must be trivially copyable");
+		public:
+			SeqLock()									{ store(T()); }
+
+			/**
+			 * Stores a new value, writes must be serialized by the caller
+			 * @param value the new value
+			 */
+			void store(const T& value)
+			{
+				Words words = {}; std::memcpy(words.data(), &value, sizeof(T));
+				auto seq = mSequence.load(std::memory_order_relaxed);
+				mSequence.store(seq + 1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_release);
+				for (size_t i = 0; i < words.size(); i++)
+					mWords[i].store(words[i], std::memory_order_relaxed);
+				mSequence.store(seq + 2, std::memory_order_release);
+			}
+
+			/**
+			 * @return a consistent copy of the current value
+			 */
+			T load() const
+			{
+				Words words; nap::uint64 begin, end;
+				do
+				{
+					begin = mSequence.load(std::memory_order_acquire);
+					for (size_t i = 0; i < words.size(); i++)
+						words[i] = mWords[i].load(std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_acquire);
+					end = mSequence.load(std::memory_order_relaxed);
+				} while ((begin & 0x01U) != 0 || begin != end);
+
+				T value; std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+				return value;
+			}
+
+		private:
+			static constexpr size_t sWordCount = (sizeof(T) + sizeof(nap::uint64) - 1) / sizeof(nap::uint64);
+			using Words = std::array<nap::uint64, sWordCount>;
+
+			std::atomic<nap::uint64> mSequence = { 0 };
+			std::array<std::atomic<nap::uint64>, sWordCount> mWords;
+		};
+	}
+}
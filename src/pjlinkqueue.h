@@ -0,0 +1,131 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+// External includes
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cassert>
+
+namespace nap
+{
+	namespace pjlink
+	{
+		/**
+		 * Bounded lock-free queue, all nodes are allocated on construction.
+		 * Safe for multiple producers and multiple consumers, pushing to a full queue fails.
+		 * Capacity is rounded up to the next power of 2.
+		 */
+		template<typename T>
+		class BoundedQueue
+		{
+		public:
+			/**
+			 * Allocates all nodes of the queue
+			 * @param capacity max number of elements, rounded up to the next power of 2
+			 */
+			BoundedQueue(size_t capacity)
+			{
+				size_t size = 2;
+				while (size < capacity)
+					size <<= 1;
+
+				mMask = size - 1;
+				mCells = std::make_unique<Cell[]>(size);
+				for (size_t i = 0; i < size; i++)
+					mCells[i].mSequence.store(i, std::memory_order_relaxed);
+			}
+
+			// Disable copy and move
+			BoundedQueue(const BoundedQueue&) = delete;
+			BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+			/**
+			 * Moves an element into the queue, fails when the queue is full.
+			 * @param value the element to push
+			 * @return if the element was pushed
+			 */
+			bool push(T&& value)
+			{
+				Cell* cell = nullptr;
+				size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+				while (true)
+				{
+					cell = &mCells[pos & mMask];
+					size_t seq = cell->mSequence.load(std::memory_order_acquire);
+					auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+					if (diff == 0)
+					{
+						if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (diff < 0)
+					{
+						return false;
+					}
+					else
+					{
+						pos = mEnqueuePos.load(std::memory_order_relaxed);
+					}
+				}
+				cell->mData = std::move(value);
+				cell->mSequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+
+			/**
+			 * Moves the next element out of the queue, fails when the queue is empty.
+			 * @param outValue the popped element
+			 * @return if an element was popped
+			 */
+			bool pop(T& outValue)
+			{
+				Cell* cell = nullptr;
+				size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+				while (true)
+				{
+					cell = &mCells[pos & mMask];
+					size_t seq = cell->mSequence.load(std::memory_order_acquire);
+					auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+					if (diff == 0)
+					{
+						if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+							break;
+					}
+					else if (diff < 0)
+					{
+						return false;
+					}
+					else
+					{
+						pos = mDequeuePos.load(std::memory_order_relaxed);
+					}
+				}
+				outValue = std::move(cell->mData);
+				cell->mData = T();
+				cell->mSequence.store(pos + mMask + 1, std::memory_order_release);
+				return true;
+			}
+
+			/**
+			 * @return max number of elements
+			 */
+			size_t capacity() const						{ return mMask + 1; }
+
+		private:
+			struct Cell
+			{
+				std::atomic<size_t> mSequence = { 0 };
+				T mData;
+			};
+
+			std::unique_ptr<Cell[]> mCells;								//< All preallocated nodes
+			size_t mMask = 0;											//< Capacity - 1
+			alignas(64) std::atomic<size_t> mEnqueuePos = { 0 };		//< Next write position
+			alignas(64) std::atomic<size_t> mDequeuePos = { 0 };		//< Next read position
+		};
+	}
+}